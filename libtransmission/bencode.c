@@ -24,7 +24,7 @@
 
 #define LIST_SIZE 20
 
-int tr_bencLoad( char * buf, benc_val_t * val, char ** end )
+int tr_bencLoad( char * buf, int len, benc_val_t * val, char ** end )
 {
     char * p, * foo;
 
@@ -36,9 +36,18 @@ int tr_bencLoad( char * buf, benc_val_t * val, char ** end )
 
     val->begin = buf;
 
+    if( len < 2 )
+    {
+        return 1;
+    }
+
     if( buf[0] == 'i' )
     {
         /* Integer: i1242e */
+        if( !( p = memchr( buf, 'e', len ) ) )
+        {
+            return 1;
+        }
         val->type  = TYPE_INT;
         val->val.i = strtoll( &buf[1], &p, 10 );
 
@@ -66,8 +75,18 @@ int tr_bencLoad( char * buf, benc_val_t * val, char ** end )
         val->val.l.vals  = malloc( LIST_SIZE * sizeof( benc_val_t ) );
         cur              = &buf[1];
         str_expected     = 1;
-        while( cur[0] != 'e' )
+        for( ;; )
         {
+            if( cur >= &buf[len] )
+            {
+                /* Truncated */
+                tr_bencFree( val );
+                return 1;
+            }
+            if( cur[0] == 'e' )
+            {
+                break;
+            }
             if( val->val.l.count == val->val.l.alloc )
             {
                 /* We need a bigger boat */
@@ -75,23 +94,27 @@ int tr_bencLoad( char * buf, benc_val_t * val, char ** end )
                 val->val.l.vals   =  realloc( val->val.l.vals,
                         val->val.l.alloc  * sizeof( benc_val_t ) );
             }
-            if( tr_bencLoad( cur, &val->val.l.vals[val->val.l.count], &p ) )
+            if( tr_bencLoad( cur, &buf[len] - cur,
+                             &val->val.l.vals[val->val.l.count], &p ) )
             {
+                tr_bencFree( val );
                 return 1;
             }
+            val->val.l.count++;
             if( is_dict && str_expected &&
-                val->val.l.vals[val->val.l.count].type != TYPE_STR )
+                val->val.l.vals[val->val.l.count-1].type != TYPE_STR )
             {
+                tr_bencFree( val );
                 return 1;
             }
             str_expected = !str_expected;
 
-            val->val.l.count++;
             cur = p;
         }
 
         if( is_dict && ( val->val.l.count & 1 ) )
         {
+            tr_bencFree( val );
             return 1;
         }
 
@@ -100,10 +123,15 @@ int tr_bencLoad( char * buf, benc_val_t * val, char ** end )
     else
     {
         /* String: 12:whateverword */
+        if( !( p = memchr( buf, ':', MIN( len, 12 ) ) ) )
+        {
+            return 1;
+        }
         val->type    = TYPE_STR;
         val->val.s.i = strtol( buf, &p, 10 );
 
-        if( p == buf || p[0] != ':' )
+        if( p == buf || p[0] != ':' || val->val.s.i < 0 ||
+            val->val.s.i > &buf[len] - ( p + 1 ) )
         {
             return 1;
         }
@@ -49,7 +49,8 @@ typedef struct benc_val_s
     } val;
 } benc_val_t;
 
-int          tr_bencLoad( char * buf, benc_val_t * val, char ** end );
+int          tr_bencLoad( char * buf, int len, benc_val_t * val,
+                          char ** end );
 void         tr_bencPrint( benc_val_t * val );
 void         tr_bencFree( benc_val_t * val );
 benc_val_t * tr_bencDictFind( benc_val_t * val, char * key );
@@ -0,0 +1,342 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/* How much memory we use by default to hold blocks of pieces we are
+   downloading, for all torrents together */
+#define CACHE_SIZE (8*1024*1024)
+
+/* Same thing, for pieces we read to upload them */
+#define READ_CACHE_SIZE (16*1024*1024)
+
+/* A piece we have, kept in memory so we don't read it again for every
+   peer that asks for it */
+typedef struct
+{
+    tr_torrent_t * tor;
+    int            piece;
+    int            size;
+    uint8_t      * buf;
+    uint64_t       date;
+}
+tr_readpiece_t;
+
+struct tr_cache_s
+{
+    tr_lock_t        lock;
+    int              limit;
+    int              used;
+
+    uint64_t         hits;    /* Pieces hashed from memory */
+    uint64_t         misses;  /* Pieces we had to read back from disk */
+    uint64_t         flushes; /* Pieces written early to make room */
+
+    int              readLimit;
+    int              readUsed;
+    int              readCount;
+    int              readAlloc;
+    tr_readpiece_t * read;
+    uint64_t         readDate;
+
+    uint64_t         readHits;
+    uint64_t         readMisses;
+    uint64_t         readPrefetches;
+};
+
+static int  findRead( tr_cache_t *, tr_torrent_t *, int );
+static void dropRead( tr_cache_t *, int );
+
+/***********************************************************************
+ * tr_cacheInit
+ ***********************************************************************
+ * For the write cache, only keeps the accounting: each torrent holds
+ * its own blocks (see inout.c) and asks here before it allocates more.
+ * The read cache holds whole pieces of all torrents.
+ **********************************************************************/
+tr_cache_t * tr_cacheInit()
+{
+    tr_cache_t * c;
+
+    c = calloc( sizeof( tr_cache_t ), 1 );
+    c->limit     = CACHE_SIZE;
+    c->readLimit = READ_CACHE_SIZE;
+    tr_lockInit( &c->lock );
+
+    return c;
+}
+
+void tr_cacheSetLimit( tr_cache_t * c, int limit )
+{
+    tr_lockLock( c->lock );
+    c->limit = MAX( limit, 0 );
+    tr_lockUnlock( c->lock );
+}
+
+void tr_cacheSetReadLimit( tr_cache_t * c, int limit )
+{
+    int i, lru;
+
+    tr_lockLock( c->lock );
+    c->readLimit = MAX( limit, 0 );
+    while( c->readUsed > c->readLimit )
+    {
+        for( i = 0, lru = 0; i < c->readCount; i++ )
+        {
+            if( c->read[i].date < c->read[lru].date )
+            {
+                lru = i;
+            }
+        }
+        dropRead( c, lru );
+    }
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_cacheReserve
+ ***********************************************************************
+ * Returns 0 and accounts for 'size' more bytes if they fit in the
+ * budget, 1 otherwise
+ **********************************************************************/
+int tr_cacheReserve( tr_cache_t * c, int size )
+{
+    int ret = 1;
+
+    tr_lockLock( c->lock );
+    if( c->used + size <= c->limit )
+    {
+        c->used += size;
+        ret      = 0;
+    }
+    tr_lockUnlock( c->lock );
+
+    return ret;
+}
+
+void tr_cacheRelease( tr_cache_t * c, int size )
+{
+    tr_lockLock( c->lock );
+    c->used -= size;
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_cacheHashed
+ ***********************************************************************
+ * A piece was checked, 'fromMemory' tells whether all of it was in
+ * the cache
+ **********************************************************************/
+void tr_cacheHashed( tr_cache_t * c, int fromMemory )
+{
+    tr_lockLock( c->lock );
+    if( fromMemory )
+    {
+        (c->hits)++;
+    }
+    else
+    {
+        (c->misses)++;
+    }
+    tr_lockUnlock( c->lock );
+}
+
+void tr_cacheFlushed( tr_cache_t * c )
+{
+    tr_lockLock( c->lock );
+    (c->flushes)++;
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_cacheRead
+ ***********************************************************************
+ * Copies 'length' bytes at 'begin' in 'piece' to 'buf' and returns 0
+ * if we have the piece in memory, returns 1 otherwise
+ **********************************************************************/
+int tr_cacheRead( tr_cache_t * c, tr_torrent_t * tor, int piece,
+                  int begin, int length, uint8_t * buf )
+{
+    int i;
+
+    tr_lockLock( c->lock );
+    if( ( i = findRead( c, tor, piece ) ) < 0 ||
+        begin + length > c->read[i].size )
+    {
+        (c->readMisses)++;
+        tr_lockUnlock( c->lock );
+        return 1;
+    }
+
+    memcpy( buf, &c->read[i].buf[begin], length );
+    c->read[i].date = ++(c->readDate);
+    (c->readHits)++;
+    tr_lockUnlock( c->lock );
+
+    return 0;
+}
+
+/***********************************************************************
+ * tr_cacheWants
+ ***********************************************************************
+ * Returns 1 if we would keep a piece of 'size' bytes that we don't
+ * have in memory yet
+ **********************************************************************/
+int tr_cacheWants( tr_cache_t * c, tr_torrent_t * tor, int piece,
+                   int size )
+{
+    int ret;
+
+    tr_lockLock( c->lock );
+    ret = ( size <= c->readLimit && findRead( c, tor, piece ) < 0 );
+    tr_lockUnlock( c->lock );
+
+    return ret;
+}
+
+/***********************************************************************
+ * tr_cacheAdd
+ ***********************************************************************
+ * Keeps 'buf', which holds the whole piece and was malloc'ed, making
+ * room by forgetting the least recently read pieces. 'prefetch' tells
+ * whether nobody asked for it yet.
+ **********************************************************************/
+void tr_cacheAdd( tr_cache_t * c, tr_torrent_t * tor, int piece,
+                  uint8_t * buf, int size, int prefetch )
+{
+    tr_readpiece_t * r;
+    int              i, lru;
+
+    tr_lockLock( c->lock );
+
+    if( size > c->readLimit || findRead( c, tor, piece ) > -1 )
+    {
+        tr_lockUnlock( c->lock );
+        free( buf );
+        return;
+    }
+
+    while( c->readUsed + size > c->readLimit )
+    {
+        for( i = 0, lru = 0; i < c->readCount; i++ )
+        {
+            if( c->read[i].date < c->read[lru].date )
+            {
+                lru = i;
+            }
+        }
+        dropRead( c, lru );
+    }
+
+    if( c->readCount >= c->readAlloc )
+    {
+        c->readAlloc = MAX( 2 * c->readAlloc, 16 );
+        c->read      = realloc( c->read,
+                                c->readAlloc * sizeof( tr_readpiece_t ) );
+    }
+    r        = &c->read[(c->readCount)++];
+    r->tor   = tor;
+    r->piece = piece;
+    r->size  = size;
+    r->buf   = buf;
+    r->date  = ++(c->readDate);
+
+    c->readUsed += size;
+    if( prefetch )
+    {
+        (c->readPrefetches)++;
+    }
+
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_cacheForget
+ ***********************************************************************
+ * Frees all pieces of a torrent we are stopping
+ **********************************************************************/
+void tr_cacheForget( tr_cache_t * c, tr_torrent_t * tor )
+{
+    int i;
+
+    tr_lockLock( c->lock );
+    for( i = 0; i < c->readCount; )
+    {
+        if( c->read[i].tor == tor )
+        {
+            dropRead( c, i );
+            continue;
+        }
+        i++;
+    }
+    tr_lockUnlock( c->lock );
+}
+
+void tr_cacheFillStat( tr_cache_t * c, tr_cachestat_t * s )
+{
+    tr_lockLock( c->lock );
+    s->writeLimit   = c->limit;
+    s->writeUsed    = c->used;
+    s->writeHits    = c->hits;
+    s->writeMisses  = c->misses;
+    s->writeFlushes = c->flushes;
+    s->readLimit      = c->readLimit;
+    s->readUsed       = c->readUsed;
+    s->readHits       = c->readHits;
+    s->readMisses     = c->readMisses;
+    s->readPrefetches = c->readPrefetches;
+    tr_lockUnlock( c->lock );
+}
+
+void tr_cacheClose( tr_cache_t * c )
+{
+    while( c->readCount > 0 )
+    {
+        dropRead( c, 0 );
+    }
+    free( c->read );
+    tr_lockClose( c->lock );
+    free( c );
+}
+
+static int findRead( tr_cache_t * c, tr_torrent_t * tor, int piece )
+{
+    int i;
+
+    for( i = 0; i < c->readCount; i++ )
+    {
+        if( c->read[i].tor == tor && c->read[i].piece == piece )
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void dropRead( tr_cache_t * c, int i )
+{
+    c->readUsed -= c->read[i].size;
+    free( c->read[i].buf );
+    (c->readCount)--;
+    c->read[i] = c->read[c->readCount];
+}
@@ -0,0 +1,44 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TR_CACHE_H
+#define TR_CACHE_H 1
+
+typedef struct tr_cache_s tr_cache_t;
+
+tr_cache_t * tr_cacheInit       ();
+void         tr_cacheSetLimit   ( tr_cache_t *, int );
+int          tr_cacheReserve    ( tr_cache_t *, int );
+void         tr_cacheRelease    ( tr_cache_t *, int );
+void         tr_cacheHashed     ( tr_cache_t *, int );
+void         tr_cacheFlushed    ( tr_cache_t * );
+void         tr_cacheSetReadLimit( tr_cache_t *, int );
+int          tr_cacheRead       ( tr_cache_t *, tr_torrent_t *, int, int,
+                                  int, uint8_t * );
+int          tr_cacheWants      ( tr_cache_t *, tr_torrent_t *, int, int );
+void         tr_cacheAdd        ( tr_cache_t *, tr_torrent_t *, int,
+                                  uint8_t *, int, int );
+void         tr_cacheForget     ( tr_cache_t *, tr_torrent_t * );
+void         tr_cacheFillStat   ( tr_cache_t *, tr_cachestat_t * );
+void         tr_cacheClose      ( tr_cache_t * );
+
+#endif
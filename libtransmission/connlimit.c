@@ -0,0 +1,129 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/* Defaults: no more than 8 outgoing connections waiting for connect()
+   to complete, and no more than 10 new attempts per second, for all
+   torrents together */
+#define HALF_OPEN  8
+#define PER_SECOND 10
+
+struct tr_connlimit_s
+{
+    tr_lock_t lock;
+    int       halfOpen;  /* Max number of half-open connections */
+    int       perSecond; /* Max number of connect() per second */
+    int       count;     /* Number of half-open connections */
+    int       tokens;    /* How many connect() we may do right now */
+    uint64_t  date;      /* Last time we refilled 'tokens' */
+};
+
+tr_connlimit_t * tr_connlimitInit()
+{
+    tr_connlimit_t * c;
+
+    c = calloc( sizeof( tr_connlimit_t ), 1 );
+    c->halfOpen  = HALF_OPEN;
+    c->perSecond = PER_SECOND;
+    c->tokens    = PER_SECOND;
+    c->date      = tr_date();
+    tr_lockInit( &c->lock );
+
+    return c;
+}
+
+void tr_connlimitSet( tr_connlimit_t * c, int halfOpen, int perSecond )
+{
+    tr_lockLock( c->lock );
+    c->halfOpen  = MAX( halfOpen, 1 );
+    c->perSecond = MAX( perSecond, 1 );
+    c->tokens    = MIN( c->tokens, c->perSecond );
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_connlimitReserve
+ ***********************************************************************
+ * Returns 1 and counts one more half-open connection if we are allowed
+ * to call connect() now, 0 otherwise. Attempts are spread over time:
+ * we earn 'perSecond' attempts per second, up to 'perSecond' in
+ * advance.
+ **********************************************************************/
+int tr_connlimitReserve( tr_connlimit_t * c )
+{
+    int      ret = 0;
+    uint64_t now;
+    int      earned;
+
+    tr_lockLock( c->lock );
+
+    now    = tr_date();
+    earned = ( now - c->date ) * c->perSecond / 1000;
+    if( earned > 0 )
+    {
+        c->tokens = MIN( c->tokens + earned, c->perSecond );
+        c->date   = now;
+    }
+
+    if( c->count < c->halfOpen && c->tokens > 0 )
+    {
+        (c->count)++;
+        (c->tokens)--;
+        ret = 1;
+    }
+
+    tr_lockUnlock( c->lock );
+
+    return ret;
+}
+
+/***********************************************************************
+ * tr_connlimitRelease
+ ***********************************************************************
+ * The connection succeeded, failed or was given up
+ **********************************************************************/
+void tr_connlimitRelease( tr_connlimit_t * c )
+{
+    tr_lockLock( c->lock );
+    (c->count)--;
+    tr_lockUnlock( c->lock );
+}
+
+/***********************************************************************
+ * tr_connlimitCancel
+ ***********************************************************************
+ * We reserved a slot but eventually didn't call connect()
+ **********************************************************************/
+void tr_connlimitCancel( tr_connlimit_t * c )
+{
+    tr_lockLock( c->lock );
+    (c->count)--;
+    c->tokens = MIN( c->tokens + 1, c->perSecond );
+    tr_lockUnlock( c->lock );
+}
+
+void tr_connlimitClose( tr_connlimit_t * c )
+{
+    tr_lockClose( c->lock );
+    free( c );
+}
@@ -0,0 +1,267 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/* How many threads do the disk work, and how many jobs may be waiting
+   or running at once, for all torrents together */
+#define THREAD_COUNT 4
+#define JOB_COUNT    32
+
+#define JOB_FREE    0
+#define JOB_QUEUED  1
+#define JOB_RUNNING 2
+#define JOB_DONE    3
+
+typedef struct
+{
+    int        status;
+    uint64_t   id;    /* To run them in order */
+    void     * owner;
+    void    (* work)( void * );
+    void    (* done)( void * );
+    void     * data;
+}
+tr_job_t;
+
+struct tr_disk_s
+{
+    tr_lock_t   lock;
+    tr_job_t    jobs[JOB_COUNT];
+    uint64_t    id;
+
+    volatile char die;
+    tr_thread_t threads[THREAD_COUNT];
+};
+
+static void diskLoop( void * );
+
+/***********************************************************************
+ * tr_diskInit
+ ***********************************************************************
+ * Starts the threads that read and write for torrents, so a slow disk
+ * doesn't hold the torrent lock and stall all the peers
+ **********************************************************************/
+tr_disk_t * tr_diskInit()
+{
+    tr_disk_t * d;
+    int         i;
+
+    d = calloc( sizeof( tr_disk_t ), 1 );
+    tr_lockInit( &d->lock );
+    for( i = 0; i < THREAD_COUNT; i++ )
+    {
+        tr_threadCreate( &d->threads[i], diskLoop, d );
+    }
+
+    return d;
+}
+
+/***********************************************************************
+ * tr_diskQueue
+ ***********************************************************************
+ * Has 'work' run with 'data' by one of the threads. 'done' will then
+ * be run by the next tr_diskPulse for 'owner', from the owner's own
+ * thread. Returns 1 if there are too many jobs already, in which case
+ * nothing is done.
+ **********************************************************************/
+int tr_diskQueue( tr_disk_t * d, void * owner, void (*work)( void * ),
+                  void (*done)( void * ), void * data )
+{
+    tr_job_t * job;
+    int        i;
+
+    tr_lockLock( d->lock );
+    for( i = 0; i < JOB_COUNT; i++ )
+    {
+        job = &d->jobs[i];
+        if( job->status != JOB_FREE )
+        {
+            continue;
+        }
+        job->status = JOB_QUEUED;
+        job->id     = ++(d->id);
+        job->owner  = owner;
+        job->work   = work;
+        job->done   = done;
+        job->data   = data;
+        tr_lockUnlock( d->lock );
+        return 0;
+    }
+    tr_lockUnlock( d->lock );
+
+    return 1;
+}
+
+/***********************************************************************
+ * tr_diskFull
+ ***********************************************************************
+ * Returns 1 if tr_diskQueue would refuse a job right now
+ **********************************************************************/
+int tr_diskFull( tr_disk_t * d )
+{
+    int i, ret = 1;
+
+    tr_lockLock( d->lock );
+    for( i = 0; i < JOB_COUNT; i++ )
+    {
+        if( d->jobs[i].status == JOB_FREE )
+        {
+            ret = 0;
+            break;
+        }
+    }
+    tr_lockUnlock( d->lock );
+
+    return ret;
+}
+
+/***********************************************************************
+ * tr_diskPulse
+ ***********************************************************************
+ * Runs the 'done' callbacks of the finished jobs of 'owner', in the
+ * order they were queued
+ **********************************************************************/
+void tr_diskPulse( tr_disk_t * d, void * owner )
+{
+    tr_job_t * job;
+    void    (* done)( void * );
+    void     * data;
+    int        i, first;
+
+    for( ;; )
+    {
+        tr_lockLock( d->lock );
+        for( i = 0, first = -1; i < JOB_COUNT; i++ )
+        {
+            job = &d->jobs[i];
+            if( job->status == JOB_DONE && job->owner == owner &&
+                ( first < 0 || job->id < d->jobs[first].id ) )
+            {
+                first = i;
+            }
+        }
+        if( first < 0 )
+        {
+            tr_lockUnlock( d->lock );
+            break;
+        }
+        job         = &d->jobs[first];
+        done        = job->done;
+        data        = job->data;
+        job->status = JOB_FREE;
+        tr_lockUnlock( d->lock );
+
+        done( data );
+    }
+}
+
+/***********************************************************************
+ * tr_diskWait
+ ***********************************************************************
+ * Waits until no job of 'owner' is waiting or running. Their 'done'
+ * callbacks are left for tr_diskPulse.
+ **********************************************************************/
+void tr_diskWait( tr_disk_t * d, void * owner )
+{
+    int i, busy;
+
+    for( ;; )
+    {
+        tr_lockLock( d->lock );
+        for( i = 0, busy = 0; i < JOB_COUNT; i++ )
+        {
+            if( d->jobs[i].owner == owner &&
+                ( d->jobs[i].status == JOB_QUEUED ||
+                  d->jobs[i].status == JOB_RUNNING ) )
+            {
+                busy = 1;
+                break;
+            }
+        }
+        tr_lockUnlock( d->lock );
+
+        if( !busy )
+        {
+            break;
+        }
+        tr_wait( 2 );
+    }
+}
+
+void tr_diskClose( tr_disk_t * d )
+{
+    int i;
+
+    d->die = 1;
+    for( i = 0; i < THREAD_COUNT; i++ )
+    {
+        tr_threadJoin( d->threads[i] );
+    }
+    tr_lockClose( d->lock );
+    free( d );
+}
+
+/***********************************************************************
+ * diskLoop
+ ***********************************************************************
+ * Runs the oldest queued job, or sleeps a bit if there is none
+ **********************************************************************/
+static void diskLoop( void * _d )
+{
+    tr_disk_t * d = _d;
+    tr_job_t  * job;
+    int         i, first;
+
+#ifdef SYS_BEOS
+    signal( SIGINT, SIG_IGN );
+#endif
+
+    while( !d->die )
+    {
+        tr_lockLock( d->lock );
+        for( i = 0, first = -1; i < JOB_COUNT; i++ )
+        {
+            job = &d->jobs[i];
+            if( job->status == JOB_QUEUED &&
+                ( first < 0 || job->id < d->jobs[first].id ) )
+            {
+                first = i;
+            }
+        }
+        if( first < 0 )
+        {
+            tr_lockUnlock( d->lock );
+            tr_wait( 10 );
+            continue;
+        }
+        job         = &d->jobs[first];
+        job->status = JOB_RUNNING;
+        tr_lockUnlock( d->lock );
+
+        job->work( job->data );
+
+        tr_lockLock( d->lock );
+        job->status = JOB_DONE;
+        tr_lockUnlock( d->lock );
+    }
+}
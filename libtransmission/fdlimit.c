@@ -0,0 +1,269 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/* How many files we keep open by default, for all torrents together */
+#define BUDGET 32
+
+typedef struct tr_openfile_s
+{
+    char     * path;
+    int        fd;
+    int        write;  /* Opened read-write */
+    int        direct; /* Opened with O_DIRECT */
+    int        busy;   /* Being used, can't be closed */
+    uint64_t   date;   /* Last use, for LRU */
+}
+tr_openfile_t;
+
+struct tr_fd_s
+{
+    tr_lock_t       lock;
+    int             budget;
+    int             count;
+    int             alloc;
+    tr_openfile_t * files;
+    uint64_t        date;
+
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+};
+
+static void closeFile( tr_fd_t *, int );
+static int  evictOne( tr_fd_t * );
+
+/***********************************************************************
+ * tr_fdInit
+ ***********************************************************************
+ * Files are opened on demand and shared by all torrents. No more than
+ * 'budget' of them stay open: when we need another one, the least
+ * recently used file which nobody is reading or writing is closed.
+ **********************************************************************/
+tr_fd_t * tr_fdInit()
+{
+    tr_fd_t * f;
+
+    f = calloc( sizeof( tr_fd_t ), 1 );
+    f->budget = BUDGET;
+    tr_lockInit( &f->lock );
+
+    return f;
+}
+
+void tr_fdSetBudget( tr_fd_t * f, int budget )
+{
+    tr_lockLock( f->lock );
+    f->budget = MAX( budget, 1 );
+    while( f->count > f->budget && !evictOne( f ) );
+    tr_lockUnlock( f->lock );
+}
+
+/***********************************************************************
+ * tr_fdFileOpen
+ ***********************************************************************
+ * Returns a descriptor for 'path', opened read-write if TR_FD_WRITE is
+ * set in 'flags' or read-only otherwise, or -1 if it can't be opened.
+ * With TR_FD_DIRECT, it is opened with O_DIRECT, and failing is not
+ * an error: the filesystem may not support it. It must be given back
+ * with tr_fdFileRelease once the I/O is done.
+ **********************************************************************/
+int tr_fdFileOpen( tr_fd_t * f, char * path, int flags )
+{
+    tr_openfile_t * o;
+    int             i, fd, mode;
+    int             write  = ( flags & TR_FD_WRITE );
+    int             direct = ( flags & TR_FD_DIRECT );
+
+    tr_lockLock( f->lock );
+
+    for( i = 0; i < f->count; i++ )
+    {
+        o = &f->files[i];
+        if( o->busy || o->direct != direct || strcmp( o->path, path ) )
+        {
+            continue;
+        }
+        if( write && !o->write )
+        {
+            /* We need to write now, reopen it */
+            closeFile( f, i );
+            break;
+        }
+        (f->hits)++;
+        o->busy = 1;
+        o->date = ++(f->date);
+        tr_lockUnlock( f->lock );
+        return o->fd;
+    }
+
+    (f->misses)++;
+
+    /* Make room. If every file is in use, we go over the budget for a
+       while, tr_fdFileRelease will fix it */
+    while( f->count >= f->budget && !evictOne( f ) );
+
+    mode = write ? O_RDWR : O_RDONLY;
+    if( direct )
+    {
+#ifdef O_DIRECT
+        mode |= O_DIRECT;
+#else
+        tr_lockUnlock( f->lock );
+        return -1;
+#endif
+    }
+    fd = open( path, mode );
+    if( fd < 0 )
+    {
+        if( !direct )
+        {
+            tr_err( "Could not open %s (%s)", path, strerror( errno ) );
+        }
+        tr_lockUnlock( f->lock );
+        return -1;
+    }
+
+    if( f->count >= f->alloc )
+    {
+        f->alloc = MAX( 2 * f->alloc, 16 );
+        f->files = realloc( f->files, f->alloc * sizeof( tr_openfile_t ) );
+    }
+    o         = &f->files[(f->count)++];
+    o->path   = strdup( path );
+    o->fd     = fd;
+    o->write  = write;
+    o->direct = direct;
+    o->busy   = 1;
+    o->date   = ++(f->date);
+
+    tr_lockUnlock( f->lock );
+
+    return fd;
+}
+
+void tr_fdFileRelease( tr_fd_t * f, int fd )
+{
+    int i;
+
+    tr_lockLock( f->lock );
+    for( i = 0; i < f->count; i++ )
+    {
+        if( f->files[i].fd == fd )
+        {
+            f->files[i].busy = 0;
+            break;
+        }
+    }
+    while( f->count > f->budget && !evictOne( f ) );
+    tr_lockUnlock( f->lock );
+}
+
+/***********************************************************************
+ * tr_fdFileClose
+ ***********************************************************************
+ * Closes 'path' if it is open, because its torrent is stopped. It may
+ * be open twice, with and without O_DIRECT.
+ **********************************************************************/
+void tr_fdFileClose( tr_fd_t * f, char * path )
+{
+    int i;
+
+    tr_lockLock( f->lock );
+    for( i = 0; i < f->count; )
+    {
+        if( !f->files[i].busy && !strcmp( f->files[i].path, path ) )
+        {
+            /* The last one takes its place */
+            closeFile( f, i );
+            continue;
+        }
+        i++;
+    }
+    tr_lockUnlock( f->lock );
+}
+
+void tr_fdStat( tr_fd_t * f, tr_cachestat_t * s )
+{
+    tr_lockLock( f->lock );
+    s->fdOpen      = f->count;
+    s->fdBudget    = f->budget;
+    s->fdHits      = f->hits;
+    s->fdMisses    = f->misses;
+    s->fdEvictions = f->evictions;
+    tr_lockUnlock( f->lock );
+}
+
+void tr_fdClose( tr_fd_t * f )
+{
+    while( f->count > 0 )
+    {
+        closeFile( f, 0 );
+    }
+    free( f->files );
+    tr_lockClose( f->lock );
+    free( f );
+}
+
+/***********************************************************************
+ * closeFile
+ ***********************************************************************
+ * Closes the i-th file and removes it from the list
+ **********************************************************************/
+static void closeFile( tr_fd_t * f, int i )
+{
+    close( f->files[i].fd );
+    tr_uringClosed();
+    free( f->files[i].path );
+    (f->count)--;
+    f->files[i] = f->files[f->count];
+}
+
+/***********************************************************************
+ * evictOne
+ ***********************************************************************
+ * Closes the least recently used file which is not in use. Returns 1
+ * if they are all in use.
+ **********************************************************************/
+static int evictOne( tr_fd_t * f )
+{
+    int i, lru = -1;
+
+    for( i = 0; i < f->count; i++ )
+    {
+        if( !f->files[i].busy &&
+            ( lru < 0 || f->files[i].date < f->files[lru].date ) )
+        {
+            lru = i;
+        }
+    }
+    if( lru < 0 )
+    {
+        return 1;
+    }
+
+    closeFile( f, lru );
+    (f->evictions)++;
+
+    return 0;
+}
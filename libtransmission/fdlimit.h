@@ -0,0 +1,40 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TR_FDLIMIT_H
+#define TR_FDLIMIT_H 1
+
+typedef struct tr_fd_s tr_fd_t;
+
+/* Flags for tr_fdFileOpen */
+#define TR_FD_WRITE  1
+#define TR_FD_DIRECT 2
+
+tr_fd_t * tr_fdInit        ();
+void      tr_fdSetBudget   ( tr_fd_t *, int );
+int       tr_fdFileOpen    ( tr_fd_t *, char *, int );
+void      tr_fdFileRelease ( tr_fd_t *, int );
+void      tr_fdFileClose   ( tr_fd_t *, char * );
+void      tr_fdStat        ( tr_fd_t *, tr_cachestat_t * );
+void      tr_fdClose       ( tr_fd_t * );
+
+#endif
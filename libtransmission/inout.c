@@ -22,16 +22,30 @@
 
 #include "transmission.h"
 
-#ifdef SYS_BEOS
-# define fseeko _fseek
-#endif
+/* Blocks of a piece we are downloading, kept in memory until the piece
+   is complete. We hash them as soon as they are in order, so when the
+   last one arrives there is almost nothing left to do */
+typedef struct
+{
+    int        piece;
+    int        count;  /* How many blocks we hold */
+    uint8_t ** blocks; /* One per block of the piece, NULL if not held */
+    uint64_t   date;   /* Last time we got a block */
+
+    tr_sha1_t  sha1;   /* Hash of the first 'hashed' blocks */
+    int        hashed;
+}
+tr_cached_t;
 
 struct tr_io_s
 {
     tr_torrent_t * tor;
 
-    /* File descriptors */
-    FILE       ** fds;
+    /* Full path of each file */
+    char       ** paths;
+
+    /* Set if we read through mmap() */
+    tr_map_t    * map;
 
     /* Position of pieces
        -1 = we haven't started to download this piece yet
@@ -44,20 +58,211 @@ struct tr_io_s
     int         * slotPiece;
 
     int           slotsUsed;
+
+    /* Pieces we hold blocks of */
+    int           cachedCount;
+    tr_cached_t * cached;
+
+    /* Pieces being checked and written, or read to the read cache, by
+       the disk threads */
+    int           checking;
+    uint8_t     * loading;
+
+    /* Check of the files without resume data: the hash of each slot,
+       and of its beginning as if it held the last piece (only if that
+       one is shorter), whether it could be read, and how the disk
+       threads are getting on */
+    uint8_t     * slotHash;
+    uint8_t     * slotLastHash;
+    char        * slotRead;
+    char        * slotWanted; /* NULL if we hash all slots */
+    int           verifying;
+    int           verifyNext;
+    int           verifyEnd;
+
+    /* Pieces completed since the resume file was last saved, when that
+       was, and whether a disk thread is saving it now */
+    int           resumeDirty;
+    uint64_t      resumeDate;
+    int           resumeSaving;
+
+    /* Set once O_DIRECT failed, the filesystem doesn't support it */
+    int           noDirect;
 };
 
+/* A complete piece, handed to a disk thread to check and write it */
+typedef struct
+{
+    tr_io_t    * io;
+    int          piece;
+    uint64_t     offset;
+    int          size;
+    int          wantBuf;  /* The smart ban needs the data */
+
+    uint8_t   ** blocks;   /* NULL if we hold none */
+    tr_sha1_t    sha1;
+    int          hashed;
+
+    /* Results */
+    int          failed;
+    int          ret;
+    int          fromMemory;
+    uint8_t    * buf;
+}
+tr_checkjob_t;
+
+/* A piece to read to the read cache */
+typedef struct
+{
+    tr_io_t    * io;
+    int          piece;
+    uint64_t     offset;
+    int          size;
+    int          prefetch;
+}
+tr_loadjob_t;
+
+/* Consecutive slots for a disk thread to hash */
+typedef struct
+{
+    tr_io_t    * io;
+    int          first;
+    int          count;
+    int          size;
+}
+tr_verifyjob_t;
+
+/* The resume file, for a disk thread to save */
+typedef struct
+{
+    tr_io_t    * io;
+    uint8_t    * buf;
+    int          size;
+}
+tr_resumejob_t;
+
+/* Piece hashes, indexed by their first bytes so we find which piece a
+   slot holds without comparing against all of them. 'next' chains the
+   pieces of a bucket in ascending order */
+typedef struct
+{
+    int          mask;
+    int        * buckets;
+    int        * next;
+}
+tr_piecetable_t;
+
+/* SHA1 output is evenly spread, so its first bytes make a good key */
+#define PIECE_BUCKET(t,h) ( ( (uint32_t) (h)[0] | (h)[1] << 8 | \
+                              (h)[2] << 16 | (uint32_t) (h)[3] << 24 ) & \
+                            (uint32_t) (t)->mask )
+
+/* How many complete pieces may wait to be checked before we stop
+   asking for more blocks */
+#define MAX_CHECKING 8
+
+/* When we check files, how much a disk thread reads at once, and how
+   many such chunks a torrent may have in flight. As chunks of all
+   torrents take turns in the disk threads, torrents checking at the
+   same time share them */
+#define VERIFY_CHUNK  ( 4 * 1024 * 1024 )
+#define MAX_VERIFYING 4
+
+/* For transferRanges: IO_DIRECT reads without the system cache if the
+   torrent wants it (see tr_setDirectIO) and the I/O is aligned to
+   DIRECT_ALIGN bytes */
+#define IO_WRITE     1
+#define IO_DIRECT    2
+#define DIRECT_ALIGN 4096
+
+#ifndef POSIX_FADV_NORMAL
+/* No posix_fadvise(), adviseRange does nothing */
+#  define POSIX_FADV_SEQUENTIAL 0
+#  define POSIX_FADV_WILLNEED   0
+#  define POSIX_FADV_DONTNEED   0
+#endif
+
+/* How many pieces we complete, or for how long, before we save the
+   resume file again */
+#define RESUME_PIECES   64
+#define RESUME_INTERVAL 30000
+
+/* A contiguous range of the torrent to read or write, and the buffers
+   for it. transferRanges does several at once */
+typedef struct
+{
+    uint64_t       offset;
+    struct iovec * iov;
+    int            count;
+    int            ret;
+}
+tr_range_t;
+
+/* The part of a range that is in one file */
+typedef struct
+{
+    int            range;
+    int            fd;
+    uint64_t       pos;
+    int            seg;   /* First of its buffers in the segments */
+    int            count;
+    uint64_t       size;
+    int            op;    /* Its io_uring op, -1 if none */
+    int            direct; /* Opened with O_DIRECT */
+}
+tr_fileio_t;
+
 /***********************************************************************
  * Local prototypes
  **********************************************************************/
 static int  createFiles( tr_io_t * );
+static int  preallocateFiles( tr_io_t * );
 static int  openAndCheckFiles( tr_io_t * );
 static void closeFiles( tr_io_t * );
 static int  readOrWriteBytes( tr_io_t *, uint64_t, int, char *, int );
+static int  readOrWriteIov( tr_io_t *, uint64_t, struct iovec *, int,
+                            int );
+static int  transferIov( tr_io_t *, uint64_t, struct iovec *, int, int,
+                         tr_map_t * );
+static int  transferRanges( tr_io_t *, tr_range_t *, int, int,
+                         tr_map_t * );
+static int  fileIov( int, uint64_t, struct iovec *, int, int );
+static int  directAligned( uint64_t, struct iovec *, int );
+static void adviseRange( tr_io_t *, uint64_t, uint64_t, int );
+static void * allocBuffer( tr_io_t *, int );
+static int  hashRange( tr_io_t *, tr_map_t *, uint8_t *, uint64_t, int,
+                       tr_sha1_t * );
 static int  readOrWriteSlot( tr_io_t * io, int slot, uint8_t * buf,
                              int * size, int write );
+static void moveToFinalSlots( tr_io_t * );
 static void findSlotForPiece( tr_io_t *, int );
+static int  cacheBlock( tr_io_t *, int, int, int, uint8_t * );
+static int  findCached( tr_io_t *, int );
+static void hashBlocks( tr_io_t *, int );
+static int  readPiece( tr_io_t *, int, int, int, char *, int );
+static int  loadPiece( tr_io_t *, int, int );
+static void loadWork( void * );
+static void loadDone( void * );
+static void checkWork( void * );
+static void checkDone( void * );
+static void verifySlots( tr_io_t *, char * );
+static void verifyWork( void * );
+static void verifyDone( void * );
+static void verifyClose( tr_io_t * );
+static void havePiece( tr_io_t *, int );
+static void pieceTableInit( tr_io_t *, tr_piecetable_t *, int );
+static int  pieceTableFind( tr_io_t *, tr_piecetable_t *, uint8_t *,
+                            int );
+static void pieceTableClose( tr_piecetable_t * );
+static int  blockRanges( tr_io_t *, int, uint8_t **, uint64_t,
+                         struct iovec *, tr_range_t * );
+static int  flushCached( tr_io_t *, int );
+static void dropCached( tr_io_t *, int );
 static void fastResumeSave( tr_io_t * );
+static void fastResumeCheckpoint( tr_io_t * );
 static int  fastResumeLoad( tr_io_t * );
+static void fastResumeBlocks( tr_io_t *, uint8_t * );
+static int  bitfieldIsFull( uint8_t *, int, int );
 
 #define readBytes(io,o,s,b)  readOrWriteBytes(io,o,s,b,0)
 #define writeBytes(io,o,s,b) readOrWriteBytes(io,o,s,b,1)
@@ -74,11 +279,14 @@ tr_io_t * tr_ioInit( tr_torrent_t * tor )
 {
     tr_io_t * io;
 
-    io      = malloc( sizeof( tr_io_t ) );
-    io->tor = tor;
+    io             = calloc( sizeof( tr_io_t ), 1 );
+    io->tor        = tor;
+    io->loading    = calloc( ( tor->info.pieceCount + 7 ) / 8, 1 );
+    io->resumeDate = tr_date();
 
     if( createFiles( io ) || openAndCheckFiles( io ) )
     {
+        free( io->loading );
         free( io );
         return NULL;
     }
@@ -94,31 +302,67 @@ tr_io_t * tr_ioInit( tr_torrent_t * tor )
 int tr_ioRead( tr_io_t * io, int index, int begin, int length,
                char * buf )
 {
-    uint64_t    offset;
-    tr_info_t * inf = &io->tor->info;
+    return readPiece( io, index, begin, length, buf, 1 );
+}
 
-    offset = (uint64_t) io->pieceSlot[index] *
-        (uint64_t) inf->pieceSize + (uint64_t) begin;
+/***********************************************************************
+ * tr_ioTryRead
+ ***********************************************************************
+ * Like tr_ioRead, but if the data isn't in memory, has a disk thread
+ * read the piece to the read cache and returns 2 instead of waiting
+ * for the disk. The caller should try again later.
+ **********************************************************************/
+int tr_ioTryRead( tr_io_t * io, int index, int begin, int length,
+                  char * buf )
+{
+    return readPiece( io, index, begin, length, buf, 0 );
+}
+
+/***********************************************************************
+ * tr_ioLoading
+ ***********************************************************************
+ * Returns 1 if a disk thread is still reading the piece to the read
+ * cache
+ **********************************************************************/
+int tr_ioLoading( tr_io_t * io, int index )
+{
+    return tr_bitfieldHas( io->loading, index ) ? 1 : 0;
+}
+
+/***********************************************************************
+ * tr_ioPrefetch
+ ***********************************************************************
+ * Has a disk thread read a piece we have to the read cache before
+ * anyone asks for it, or if it has no room, asks the system to
+ **********************************************************************/
+void tr_ioPrefetch( tr_io_t * io, int index )
+{
+    tr_torrent_t * tor = io->tor;
 
-    return readBytes( io, offset, length, buf );
+    if( loadPiece( io, index, 1 ) && io->pieceSlot[index] > -1 )
+    {
+        /* No room in the read cache, let the system read ahead */
+        adviseRange( io, (uint64_t) io->pieceSlot[index] *
+                     (uint64_t) tor->info.pieceSize,
+                     tr_pieceSize( index ), POSIX_FADV_WILLNEED );
+    }
 }
 
 /***********************************************************************
  * tr_ioWrite
  ***********************************************************************
- *
+ * Once the piece is complete, it is checked and written by a disk
+ * thread, and we only learn whether it passed in tr_ioPulse
  **********************************************************************/
 int tr_ioWrite( tr_io_t * io, int index, int begin, int length,
                 char * buf )
 {
-    tr_torrent_t * tor = io->tor;
-    tr_info_t    * inf = &io->tor->info;
-    uint64_t       offset;
-    int            i;
-    uint8_t        hash[SHA_DIGEST_LENGTH];
-    uint8_t      * pieceBuf;
-    int            pieceSize;
-    int            startBlock, endBlock;
+    tr_torrent_t  * tor = io->tor;
+    tr_info_t     * inf = &io->tor->info;
+    uint64_t        offset;
+    int             i, c;
+    int             startBlock, endBlock;
+    tr_checkjob_t * job;
 
     if( io->pieceSlot[index] < 0 )
     {
@@ -130,7 +374,8 @@ int tr_ioWrite( tr_io_t * io, int index, int begin, int length,
     offset = (uint64_t) io->pieceSlot[index] *
         (uint64_t) inf->pieceSize + (uint64_t) begin;
 
-    if( writeBytes( io, offset, length, buf ) )
+    if( cacheBlock( io, index, begin, length, (uint8_t *) buf ) &&
+        writeBytes( io, offset, length, buf ) )
     {
         return 1;
     }
@@ -146,38 +391,90 @@ int tr_ioWrite( tr_io_t * io, int index, int begin, int length,
         }
     }
 
-    /* The piece is complete, check the hash */
-    pieceSize = tr_pieceSize( index );
-    pieceBuf  = malloc( pieceSize );
-    readBytes( io, (uint64_t) io->pieceSlot[index] *
-               (uint64_t) inf->pieceSize, pieceSize, pieceBuf );
-    SHA1( pieceBuf, pieceSize, hash );
-    free( pieceBuf );
-
-    if( memcmp( hash, &inf->pieces[20*index], SHA_DIGEST_LENGTH ) )
+    /* The piece is complete, hand it over with the blocks we hold and
+       what we hashed so far */
+    job          = calloc( sizeof( tr_checkjob_t ), 1 );
+    job->io      = io;
+    job->piece   = index;
+    job->offset  = (uint64_t) io->pieceSlot[index] *
+                   (uint64_t) inf->pieceSize;
+    job->size    = tr_pieceSize( index );
+    job->wantBuf = tr_banPieceRecorded( tor->ban, index );
+    if( ( c = findCached( io, index ) ) > -1 )
     {
-        tr_inf( "Piece %d (slot %d): hash FAILED", index,
-                io->pieceSlot[index] );
-
-        /* We will need to reload the whole piece */
-        for( i = startBlock; i < endBlock; i++ )
-        {
-            tor->blockHave[i]    = 0;
-            tor->blockHaveCount -= 1;
-        }
+        job->blocks = io->cached[c].blocks;
+        job->sha1   = io->cached[c].sha1;
+        job->hashed = io->cached[c].hashed;
+        io->cachedCount--;
+        io->cached[c] = io->cached[io->cachedCount];
     }
-    else
+
+    (io->checking)++;
+    if( tr_diskQueue( tor->disk, io, checkWork, checkDone, job ) )
     {
-        tr_inf( "Piece %d (slot %d): hash OK", index,
-                io->pieceSlot[index] );
-        tr_bitfieldAdd( tor->bitfield, index );
+        /* The disk threads have enough to do already */
+        checkWork( job );
+        checkDone( job );
     }
 
     return 0;
 }
 
+/***********************************************************************
+ * tr_ioPulse
+ ***********************************************************************
+ * Deals with what the disk threads have finished, and saves the resume
+ * file from time to time
+ **********************************************************************/
+void tr_ioPulse( tr_io_t * io )
+{
+    tr_diskPulse( io->tor->disk, io );
+    fastResumeCheckpoint( io );
+}
+
+/***********************************************************************
+ * tr_ioChecking
+ ***********************************************************************
+ * Returns how many complete pieces are still being checked
+ **********************************************************************/
+int tr_ioChecking( tr_io_t * io )
+{
+    return io->checking;
+}
+
+/***********************************************************************
+ * tr_ioFull
+ ***********************************************************************
+ * Returns 1 if the disk can't keep up and we should stop asking for
+ * blocks for a while
+ **********************************************************************/
+int tr_ioFull( tr_io_t * io )
+{
+    return ( io->checking >= MAX_CHECKING );
+}
+
 void tr_ioClose( tr_io_t * io )
 {
+    tr_torrent_t * tor = io->tor;
+
+    /* Let the disk threads finish what we gave them */
+    tr_diskWait( tor->disk, io );
+    tr_diskPulse( tor->disk, io );
+
+    /* Save the blocks of incomplete pieces */
+    while( io->cachedCount > 0 )
+    {
+        flushCached( io, 0 );
+        dropCached( io, 0 );
+    }
+    free( io->cached );
+    free( io->loading );
+    tr_cacheForget( tor->cache, tor );
+
+    if( io->map )
+    {
+        tr_mapClose( io->map );
+    }
     closeFiles( io );
 
     fastResumeSave( io );
@@ -253,48 +550,157 @@ static int createFiles( tr_io_t * io )
         free( path );
     }
 
+    if( tor->preallocation != TR_PREALLOC_NONE && preallocateFiles( io ) )
+    {
+        tr_err( "%s", tor->error );
+        return 1;
+    }
+
     return 0;
 }
 
 /***********************************************************************
- * openAndCheckFiles
+ * preallocateFiles
  ***********************************************************************
- * Open all files in read/write and look for complete pieces
+ * Makes sure there is room for the whole torrent before we download
+ * anything. Files are extended to their final size, and with
+ * TR_PREALLOC_FULL the blocks are also reserved without changing the
+ * size (so compact allocation still sees where the data ends). Returns
+ * 1 and fills tor->error if we can't.
  **********************************************************************/
-static int openAndCheckFiles( tr_io_t * io )
+static int preallocateFiles( tr_io_t * io )
 {
     tr_torrent_t * tor = io->tor;
     tr_info_t    * inf = &tor->info;
 
-    int i;
-    char * path;
-    uint8_t * buf;
-    uint8_t hash[SHA_DIGEST_LENGTH];
-    int startBlock, endBlock;
-
-    io->fds = malloc( inf->fileCount * sizeof( FILE * ) );
+    int           i, fd, ret = 0;
+    char        * path;
+    struct stat   sb;
+    uint64_t      length, missing = 0;
+#ifndef SYS_BEOS
+    struct statvfs vfs;
+#endif
 
-    /* Open all files */
+    /* First see if everything fits, so we don't fill the disk for
+       nothing */
     for( i = 0; i < inf->fileCount; i++ )
     {
         asprintf( &path, "%s/%s", tor->destination, inf->files[i].name );
+        if( !stat( path, &sb ) &&
+            (uint64_t) sb.st_blocks * 512 < inf->files[i].length )
+        {
+            missing += inf->files[i].length -
+                           (uint64_t) sb.st_blocks * 512;
+        }
+        free( path );
+    }
+#ifndef SYS_BEOS
+    if( missing > 0 && !statvfs( tor->destination, &vfs ) &&
+        (uint64_t) vfs.f_bavail * vfs.f_frsize < missing )
+    {
+        snprintf( tor->error, sizeof( tor->error ),
+                  "Not enough free space in %s (%llu MB needed)",
+                  tor->destination,
+                  (unsigned long long) ( missing >> 20 ) + 1 );
+        return 1;
+    }
+#endif
+
+    for( i = 0; i < inf->fileCount && !ret; i++ )
+    {
+        length = inf->files[i].length;
+        asprintf( &path, "%s/%s", tor->destination, inf->files[i].name );
 
-        if( !( io->fds[i] = fopen( path, "r+" ) ) )
+        if( ( fd = open( path, O_RDWR ) ) < 0 || fstat( fd, &sb ) )
         {
-            printf( "fopen failed for `%s'\n", path );
-            free( path );
-            free( io->fds );
-            return 1;
+            snprintf( tor->error, sizeof( tor->error ),
+                      "Could not open %s (%s)", path, strerror( errno ) );
+            ret = 1;
+            goto next;
+        }
+
+        /* Only touch files that need it, not to change their mtimes
+           and invalidate the resume file */
+        if( (uint64_t) sb.st_blocks * 512 >= length )
+        {
+            goto next;
+        }
+
+#ifdef SYS_LINUX
+        if( tor->preallocation == TR_PREALLOC_FULL )
+        {
+            if( !fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, length ) )
+            {
+                goto next;
+            }
+            if( errno != EOPNOTSUPP && errno != ENOSYS )
+            {
+                snprintf( tor->error, sizeof( tor->error ),
+                          "Could not allocate %s (%s)", path,
+                          strerror( errno ) );
+                /* Give back what we got */
+                ftruncate( fd, sb.st_size );
+                ret = 1;
+                goto next;
+            }
+            /* Not supported by this filesystem, go sparse */
+        }
+#endif
+
+        if( (uint64_t) sb.st_size < length && ftruncate( fd, length ) )
+        {
+            snprintf( tor->error, sizeof( tor->error ),
+                      "Could not extend %s (%s)", path, strerror( errno ) );
+            ret = 1;
         }
 
+      next:
+        if( fd > -1 )
+        {
+            close( fd );
+        }
         free( path );
     }
 
+    return ret;
+}
+
+/***********************************************************************
+ * openAndCheckFiles
+ ***********************************************************************
+ * Look for complete pieces. Files are not opened here, but the first
+ * time we read or write them
+ **********************************************************************/
+static int openAndCheckFiles( tr_io_t * io )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    tr_piecetable_t table;
+    int i, j, last;
+
+    io->paths = malloc( inf->fileCount * sizeof( char * ) );
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        asprintf( &io->paths[i], "%s/%s", tor->destination,
+                  inf->files[i].name );
+    }
+
+    if( tor->storage == TR_STORAGE_MMAP )
+    {
+        io->map = tr_mapInit( tor, io->paths );
+    }
+
     io->pieceSlot = malloc( inf->pieceCount * sizeof( int ) );
     io->slotPiece = malloc( inf->pieceCount * sizeof( int ) );
 
     if( !fastResumeLoad( io ) )
     {
+        if( tor->allocation == TR_ALLOC_FULL )
+        {
+            /* The resume file may come from compact allocation */
+            moveToFinalSlots( io );
+        }
         return 0;
     }
 
@@ -307,172 +713,1388 @@ static int openAndCheckFiles( tr_io_t * io )
     memset( tor->blockHave, 0, tor->blockCount );
     tor->blockHaveCount = 0;
 
-    /* Check pieces */
-    io->slotsUsed = 0;
-    buf           = malloc( inf->pieceSize );
-    for( i = 0; i < inf->pieceCount; i++ )
-    {
-        int size, j;
+    /* Hash everything first */
+    verifySlots( io, NULL );
 
-        if( readSlot( io, i, buf, &size ) )
+    if( tor->allocation == TR_ALLOC_FULL )
+    {
+        /* Each piece can only be in its own slot */
+        for( i = 0; i < inf->pieceCount; i++ )
         {
-            break;
-        }
-
-        io->slotsUsed = i + 1;
-        SHA1( buf, size, hash );
+            io->pieceSlot[i] = i;
+            io->slotPiece[i] = i;
 
-        for( j = i; j < inf->pieceCount - 1; j++ )
-        {
-            if( !memcmp( hash, &inf->pieces[20*j], SHA_DIGEST_LENGTH ) )
+            if( !io->slotRead[i] )
             {
-                int k;
-                io->pieceSlot[j] = i;
-                io->slotPiece[i] = j;
-                tr_bitfieldAdd( tor->bitfield, j );
-
-                startBlock = tr_pieceStartBlock( j );
-                endBlock   = startBlock + tr_pieceCountBlocks( j );
-                for( k = startBlock; k < endBlock; k++ )
-                {
-                    tor->blockHave[k] = -1;
-                    tor->blockHaveCount++;
-                }
-                break;
+                /* Beyond the end of the file */
+                continue;
+            }
+            if( !memcmp( &io->slotHash[20*i], &inf->pieces[20*i],
+                         SHA_DIGEST_LENGTH ) )
+            {
+                havePiece( io, i );
             }
         }
+        io->slotsUsed = inf->pieceCount;
+    }
+    else
+    {
+        /* Find out which pieces the slots we could read hold. The last
+           piece is looked for on its own if it is shorter */
+        last = io->slotLastHash ? inf->pieceCount - 1 : inf->pieceCount;
+        pieceTableInit( io, &table, last );
 
-        if( io->slotPiece[i] > -1 )
-        {
-            continue;
-        }
-
-        /* Special case for the last piece */
-        SHA1( buf, tr_pieceSize( inf->pieceCount - 1 ), hash );
-        if( !memcmp( hash, &inf->pieces[20 * (inf->pieceCount - 1)],
-                     SHA_DIGEST_LENGTH ) )
+        io->slotsUsed = 0;
+        for( i = 0; i < inf->pieceCount && io->slotRead[i]; i++ )
         {
-            io->pieceSlot[inf->pieceCount - 1] = i;
-            io->slotPiece[i]                   = inf->pieceCount - 1;
-            tr_bitfieldAdd( tor->bitfield, inf->pieceCount - 1 );
+            io->slotsUsed = i + 1;
 
-            startBlock = tr_pieceStartBlock( inf->pieceCount - 1 );
-            endBlock   = startBlock +
-                tr_pieceCountBlocks( inf->pieceCount - 1 );
-            for( j = startBlock; j < endBlock; j++ )
+            j = pieceTableFind( io, &table, &io->slotHash[20*i], i );
+            if( j < 0 && io->slotLastHash &&
+                !memcmp( &io->slotLastHash[20*i],
+                         &inf->pieces[20 * (inf->pieceCount - 1)],
+                         SHA_DIGEST_LENGTH ) )
             {
-                tor->blockHave[j] = -1;
-                tor->blockHaveCount++;
+                /* Special case for the last piece */
+                j = inf->pieceCount - 1;
+            }
+            if( j > -1 )
+            {
+                io->pieceSlot[j] = i;
+                io->slotPiece[i] = j;
+                havePiece( io, j );
             }
         }
+
+        pieceTableClose( &table );
     }
-    free( buf );
+
+    verifyClose( io );
 
     return 0;
 }
 
 /***********************************************************************
- * closeFiles
+ * verifySlots
+ ***********************************************************************
+ * Has the disk threads hash all slots, or the ones set in 'wanted', a
+ * chunk of consecutive slots at a time, and waits until they are done.
+ * When hashing all slots with compact allocation, we stop at the first
+ * slot we can't read.
  **********************************************************************/
-static void closeFiles( tr_io_t * io )
+static void verifySlots( tr_io_t * io, char * wanted )
 {
-    tr_torrent_t * tor = io->tor;
-    tr_info_t    * inf = &tor->info;
-
-    int i;
+    tr_torrent_t   * tor = io->tor;
+    tr_info_t      * inf = &tor->info;
+    tr_verifyjob_t * job;
+
+    io->slotHash   = malloc( inf->pieceCount * SHA_DIGEST_LENGTH );
+    io->slotRead   = calloc( inf->pieceCount, 1 );
+    io->slotWanted = wanted;
+    if( ( tor->allocation != TR_ALLOC_FULL || wanted ) &&
+        tr_pieceSize( inf->pieceCount - 1 ) < inf->pieceSize )
+    {
+        /* Only worth it if the last piece is shorter than the others */
+        io->slotLastHash = malloc( inf->pieceCount * SHA_DIGEST_LENGTH );
+    }
+    io->verifyNext = 0;
+    io->verifyEnd  = inf->pieceCount;
+    tor->checked   = 0;
 
-    for( i = 0; i < inf->fileCount; i++ )
+    while( io->verifyNext < io->verifyEnd || io->verifying > 0 )
     {
-        fclose( io->fds[i] );
+        while( io->verifying < MAX_VERIFYING &&
+               io->verifyNext < io->verifyEnd )
+        {
+            if( wanted && !wanted[io->verifyNext] )
+            {
+                /* Nothing to do there */
+                (io->verifyNext)++;
+                (tor->checked)++;
+                continue;
+            }
+
+            job        = malloc( sizeof( tr_verifyjob_t ) );
+            job->io    = io;
+            job->first = io->verifyNext;
+            job->count = 0;
+            job->size  = 0;
+            while( job->first + job->count < io->verifyEnd &&
+                   ( !wanted || wanted[job->first + job->count] ) &&
+                   ( !job->count || job->size +
+                     tr_pieceSize( job->first + job->count ) <=
+                     VERIFY_CHUNK ) )
+            {
+                job->size += tr_pieceSize( job->first + job->count );
+                (job->count)++;
+            }
+            if( tr_diskQueue( tor->disk, io, verifyWork, verifyDone,
+                              job ) )
+            {
+                /* The disk threads are busy, try again later */
+                free( job );
+                break;
+            }
+            io->verifyNext += job->count;
+            (io->verifying)++;
+        }
+
+        tr_wait( 2 );
+        tr_diskPulse( tor->disk, io );
     }
-    free( io->fds );
 }
 
 /***********************************************************************
- * readOrWriteBytes
+ * verifyWork
  ***********************************************************************
- *
+ * Disk thread side of verifySlots: reads all the slots of the job at
+ * once, then hashes them. With mmap, we rather hash over a mapping of
+ * our own. Either way, the system is told we read straight through and
+ * won't need the data again.
  **********************************************************************/
-static int readOrWriteBytes( tr_io_t * io, uint64_t offset, int size,
-                             char * buf, int write )
+static void verifyWork( void * _job )
 {
-    tr_torrent_t * tor = io->tor;
-    tr_info_t    * inf = &tor->info;
-
-    int          piece = offset / inf->pieceSize;
-    int          begin = offset % inf->pieceSize;
+    tr_verifyjob_t * job = _job;
+    tr_io_t        * io  = job->io;
+    tr_torrent_t   * tor = io->tor;
+    tr_info_t      * inf = &tor->info;
+
+    tr_map_t     * map = NULL;
+    uint8_t      * buf = NULL;
+    struct iovec   iov;
+    tr_sha1_t      sha1, copy;
+    uint64_t       offset;
+    int            i, n, size, cut, pos;
 
-    int          i;
-    uint64_t     foo;
-    int          file = 0;
-    uint64_t     posInFile = 0;
-    int          willRead;
+    offset = (uint64_t) job->first * (uint64_t) inf->pieceSize;
 
-    /* We can't ever read or write more than a piece at a time */
-    if( tr_pieceSize( piece ) < begin + size )
+    if( io->map )
     {
-        return 1;
+        map = tr_mapInit( tor, io->paths );
     }
-
-    /* Find which file we shall start reading/writing in */
-    foo = 0;
-    for( i = 0; i < inf->fileCount; i++ )
+    else
     {
-        if( offset < foo + inf->files[i].length )
+        adviseRange( io, offset, job->size, POSIX_FADV_SEQUENTIAL );
+        /* Without a buffer, hashRange reads each slot on its own */
+        buf          = allocBuffer( io, job->size );
+        iov.iov_base = buf;
+        iov.iov_len  = job->size;
+        if( buf && transferIov( io, offset, &iov, 1, IO_DIRECT, NULL ) )
         {
-            file      = i;
-            posInFile = offset - foo;
-            break;
+            /* Some of it is beyond the end of the files, read each
+               slot on its own */
+            free( buf );
+            buf = NULL;
         }
-        foo += inf->files[i].length;
     }
 
-    while( size > 0 )
+    for( n = 0, pos = 0; n < job->count; n++, pos += size )
     {
-        willRead = MIN( inf->files[file].length - posInFile,
-                          (uint64_t) size );
+        i    = job->first + n;
+        size = tr_pieceSize( i );
+        cut  = size;
+        if( io->slotLastHash )
+        {
+            cut = MIN( size, tr_pieceSize( inf->pieceCount - 1 ) );
+        }
 
-        if( fseeko( io->fds[file], posInFile, SEEK_SET ) )
+        tr_sha1Init( &sha1 );
+        if( hashRange( io, map, buf ? &buf[pos] : NULL, offset + pos,
+                       cut, &sha1 ) )
         {
-            return 1;
+            continue;
         }
-        if( write )
+        if( io->slotLastHash )
         {
-            if( fwrite( buf, willRead, 1, io->fds[file] ) != 1 )
-            {
-                return 1;
-            }
+            copy = sha1;
+            tr_sha1Final( &copy, &io->slotLastHash[20*i] );
         }
-        else
+        if( cut < size &&
+            hashRange( io, map, buf ? &buf[pos+cut] : NULL,
+                       offset + pos + cut, size - cut, &sha1 ) )
         {
-            if( fread( buf, willRead, 1, io->fds[file] ) != 1 )
-            {
-                return 1;
-            }
+            continue;
         }
+        tr_sha1Final( &sha1, &io->slotHash[20*i] );
+        io->slotRead[i] = 1;
+    }
 
-        /* 'willRead' less bytes to do */
-        size -= willRead;
-        buf  += willRead;
-
-        /* Go to the beginning of the next file */
-        file      += 1;
-        posInFile  = 0;
+    free( buf );
+    if( map )
+    {
+        tr_mapClose( map );
     }
 
-    return 0;
+    /* We are done with these, don't let them push out what others
+       use */
+    adviseRange( io, offset, job->size, POSIX_FADV_DONTNEED );
 }
 
-/***********************************************************************
- * readSlot
- ***********************************************************************
- * 
- **********************************************************************/
-static int readOrWriteSlot( tr_io_t * io, int slot, uint8_t * buf,
-                            int * size, int write )
+static void verifyDone( void * _job )
 {
-    tr_torrent_t * tor = io->tor;
-    tr_info_t    * inf = &tor->info;
+    tr_verifyjob_t * job = _job;
+    tr_io_t        * io  = job->io;
+    tr_torrent_t   * tor = io->tor;
+    int              i;
+
+    (io->verifying)--;
+    tor->checked += job->count;
+
+    if( tor->allocation != TR_ALLOC_FULL && !io->slotWanted )
+    {
+        /* Nothing after an unreadable slot is used */
+        for( i = job->first; i < job->first + job->count; i++ )
+        {
+            if( !io->slotRead[i] )
+            {
+                io->verifyEnd = MIN( io->verifyEnd, i );
+                break;
+            }
+        }
+    }
+    free( job );
+}
+
+static void verifyClose( tr_io_t * io )
+{
+    free( io->slotHash );
+    free( io->slotLastHash );
+    free( io->slotRead );
+    io->slotHash     = NULL;
+    io->slotLastHash = NULL;
+    io->slotRead     = NULL;
+    io->slotWanted   = NULL;
+}
+
+/***********************************************************************
+ * havePiece
+ ***********************************************************************
+ * Marks a piece we found on the disk as complete
+ **********************************************************************/
+static void havePiece( tr_io_t * io, int piece )
+{
+    tr_torrent_t * tor = io->tor;
+    int            i, startBlock, endBlock;
+
+    tr_bitfieldAdd( tor->bitfield, piece );
+    startBlock = tr_pieceStartBlock( piece );
+    endBlock   = startBlock + tr_pieceCountBlocks( piece );
+    for( i = startBlock; i < endBlock; i++ )
+    {
+        tor->blockHave[i] = -1;
+        tor->blockHaveCount++;
+    }
+}
+
+/***********************************************************************
+ * pieceTableInit
+ ***********************************************************************
+ * Indexes the hashes of pieces 0 to count - 1
+ **********************************************************************/
+static void pieceTableInit( tr_io_t * io, tr_piecetable_t * t, int count )
+{
+    tr_info_t * inf = &io->tor->info;
+    int         i, size, b;
+
+    /* At least twice as many buckets as pieces */
+    for( size = 16; size < 2 * count; size *= 2 );
+
+    t->mask    = size - 1;
+    t->buckets = malloc( size * sizeof( int ) );
+    t->next    = malloc( MAX( count, 1 ) * sizeof( int ) );
+    memset( t->buckets, 0xFF, size * sizeof( int ) );
+
+    /* Going backwards, so each bucket ends up in ascending order */
+    for( i = count - 1; i >= 0; i-- )
+    {
+        b             = PIECE_BUCKET( t, &inf->pieces[20*i] );
+        t->next[i]    = t->buckets[b];
+        t->buckets[b] = i;
+    }
+}
+
+/***********************************************************************
+ * pieceTableFind
+ ***********************************************************************
+ * Returns the first piece from 'first' on whose hash is 'hash', or -1.
+ * Pieces before 'first' may share it if the torrent has the same data
+ * several times, they are skipped like the old linear search did.
+ **********************************************************************/
+static int pieceTableFind( tr_io_t * io, tr_piecetable_t * t,
+                           uint8_t * hash, int first )
+{
+    tr_info_t * inf = &io->tor->info;
+    int         i;
+
+    for( i = t->buckets[PIECE_BUCKET( t, hash )]; i > -1;
+         i = t->next[i] )
+    {
+        if( i >= first && !memcmp( hash, &inf->pieces[20*i],
+                                   SHA_DIGEST_LENGTH ) )
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void pieceTableClose( tr_piecetable_t * t )
+{
+    free( t->buckets );
+    free( t->next );
+}
+
+/***********************************************************************
+ * closeFiles
+ **********************************************************************/
+static void closeFiles( tr_io_t * io )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    int i;
+
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        tr_fdFileClose( tor->fdlimit, io->paths[i] );
+        free( io->paths[i] );
+    }
+    free( io->paths );
+}
+
+/***********************************************************************
+ * readOrWriteBytes
+ ***********************************************************************
+ *
+ **********************************************************************/
+static int readOrWriteBytes( tr_io_t * io, uint64_t offset, int size,
+                             char * buf, int write )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    int          piece = offset / inf->pieceSize;
+    int          begin = offset % inf->pieceSize;
+    struct iovec iov;
+
+    /* We can't ever read or write more than a piece at a time */
+    if( tr_pieceSize( piece ) < begin + size )
+    {
+        return 1;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len  = size;
+
+    return readOrWriteIov( io, offset, &iov, 1, write );
+}
+
+/***********************************************************************
+ * readOrWriteIov
+ ***********************************************************************
+ * Reads or writes the 'count' buffers in 'iov' as one contiguous range
+ * starting at 'offset' in the torrent. That takes one positional
+ * system call per file the range covers, and doesn't move any file
+ * position, so it is safe to do from several threads at once.
+ **********************************************************************/
+static int readOrWriteIov( tr_io_t * io, uint64_t offset,
+                           struct iovec * iov, int count, int write )
+{
+    return transferIov( io, offset, iov, count, write, io->map );
+}
+
+/***********************************************************************
+ * transferIov
+ ***********************************************************************
+ * Does the job of readOrWriteIov, reading through 'map' unless it is
+ * NULL. Disk threads don't use the mapping, which is not thread-safe.
+ **********************************************************************/
+static int transferIov( tr_io_t * io, uint64_t offset,
+                        struct iovec * iov, int count, int flags,
+                        tr_map_t * map )
+{
+    tr_range_t range;
+
+    range.offset = offset;
+    range.iov    = iov;
+    range.count  = count;
+
+    return transferRanges( io, &range, 1, flags, map );
+}
+
+/***********************************************************************
+ * transferRanges
+ ***********************************************************************
+ * Reads or writes several ranges, setting 'ret' for each of them.
+ * Returns 1 if any failed. With io_uring, everything goes in one
+ * system call; otherwise, or for what can't, that is one positional
+ * call per file each range covers. 'flags' is IO_WRITE to write, and
+ * may have IO_DIRECT for reads.
+ **********************************************************************/
+static int transferRanges( tr_io_t * io, tr_range_t * ranges,
+                           int rangeCount, int flags, tr_map_t * map )
+{
+    tr_torrent_t * tor   = io->tor;
+    tr_info_t    * inf   = &tor->info;
+    tr_uring_t   * u     = NULL;
+    int            write = ( flags & IO_WRITE );
+
+    int            i, k, n, file, fd, direct, ret = 0;
+    int            fioCount = 0, fioAlloc = 0, segCount = 0, segAlloc = 0;
+    uint64_t       posInFile, size, left;
+    size_t         done, len;
+    tr_range_t   * r;
+    tr_fileio_t  * fio = NULL, * f;
+    struct iovec * seg = NULL;
+
+    for( k = 0; k < rangeCount; k++ )
+    {
+        r      = &ranges[k];
+        r->ret = 0;
+
+        for( i = 0, size = 0; i < r->count; i++ )
+        {
+            size += r->iov[i].iov_len;
+        }
+        if( r->offset > inf->totalSize ||
+            size > inf->totalSize - r->offset )
+        {
+            r->ret = 1;
+            continue;
+        }
+
+        /* Find which file we shall start reading/writing in */
+        file = tr_geometryFile( io->tor, r->offset, &posInFile );
+
+        /* Cut the buffers at file boundaries */
+        i    = 0;
+        done = 0;
+        while( i < r->count )
+        {
+            if( file >= inf->fileCount )
+            {
+                r->ret = 1;
+                break;
+            }
+            if( segCount + r->count - i > segAlloc )
+            {
+                segAlloc = MAX( 2 * segAlloc, segCount + r->count - i );
+                seg      = realloc( seg, segAlloc * sizeof( struct iovec ) );
+            }
+
+            left = inf->files[file].length - posInFile;
+            for( n = 0, size = 0; i < r->count && size < left; )
+            {
+                len = MIN( r->iov[i].iov_len - done, left - size );
+                if( len > 0 )
+                {
+                    seg[segCount+n].iov_base =
+                        (char *) r->iov[i].iov_base + done;
+                    seg[segCount+n].iov_len  = len;
+                    n++;
+                    size += len;
+                }
+                done += len;
+                if( done >= r->iov[i].iov_len )
+                {
+                    i++;
+                    done = 0;
+                }
+            }
+            /* Read through the mapping if we can */
+            if( n > 0 && ( write || !map ||
+                tr_mapRead( map, file, posInFile, &seg[segCount], n ) ) )
+            {
+                fd = direct = -1;
+                if( ( flags & IO_DIRECT ) && !write && tor->directIO &&
+                    !io->noDirect &&
+                    directAligned( posInFile, &seg[segCount], n ) &&
+                    ( fd = direct = tr_fdFileOpen( tor->fdlimit,
+                          io->paths[file], TR_FD_DIRECT ) ) < 0 )
+                {
+                    tr_inf( "Could not use O_DIRECT, reading through "
+                            "the system cache" );
+                    io->noDirect = 1;
+                }
+
+                /* Once we have everything, files are only read from.
+                   Open them read-only so a seed can use read-only
+                   media */
+                if( fd < 0 )
+                {
+                    fd = tr_fdFileOpen( tor->fdlimit, io->paths[file],
+                                        ( write || tor->blockHaveCount <
+                                          tor->blockCount ) ?
+                                        TR_FD_WRITE : 0 );
+                }
+                if( fd < 0 )
+                {
+                    r->ret = 1;
+                    break;
+                }
+                if( fioCount >= fioAlloc )
+                {
+                    fioAlloc = MAX( 2 * fioAlloc, 8 );
+                    fio      = realloc( fio,
+                                        fioAlloc * sizeof( tr_fileio_t ) );
+                }
+                f        = &fio[fioCount++];
+                f->range = k;
+                f->fd    = fd;
+                f->pos   = posInFile;
+                f->seg   = segCount;
+                f->count = n;
+                f->size   = size;
+                f->op     = -1;
+                f->direct = ( direct > -1 && fd == direct );
+                segCount += n;
+            }
+
+            /* Go to the beginning of the next file */
+            file      += 1;
+            posInFile  = 0;
+        }
+    }
+
+    if( fioCount > 0 && tor->ioUring && ( u = tr_uringGet() ) )
+    {
+        for( k = 0; k < fioCount; k++ )
+        {
+            f     = &fio[k];
+            f->op = tr_uringFile( u, f->fd, f->pos, &seg[f->seg],
+                                  f->count, write );
+        }
+        tr_uringSubmit( u );
+    }
+
+    /* Whatever didn't go through the ring, or came back short, is done
+       the usual way. Some filesystems accept O_DIRECT but refuse the
+       reads, mark these ranges with 2 to read them again */
+    for( k = 0; k < fioCount; k++ )
+    {
+        f = &fio[k];
+        if( ( f->op < 0 || tr_uringResult( u, f->op ) != (int) f->size ) &&
+            fileIov( f->fd, f->pos, &seg[f->seg], f->count, write ) )
+        {
+            if( f->direct && errno == EINVAL )
+            {
+                tr_inf( "Could not read with O_DIRECT, reading through "
+                        "the system cache" );
+                io->noDirect          = 1;
+                ranges[f->range].ret |= 2;
+            }
+            else
+            {
+                ranges[f->range].ret |= 1;
+            }
+        }
+        tr_fdFileRelease( tor->fdlimit, f->fd );
+    }
+    free( fio );
+    free( seg );
+
+    for( k = 0; k < rangeCount; k++ )
+    {
+        if( ranges[k].ret == 2 )
+        {
+            ranges[k].ret = transferRanges( io, &ranges[k], 1,
+                                            flags & ~IO_DIRECT, map );
+        }
+        ret |= ranges[k].ret;
+    }
+
+    return ret;
+}
+
+/***********************************************************************
+ * hashRange
+ ***********************************************************************
+ * Adds 'size' bytes at 'offset' in the torrent to 'sha1': from 'data'
+ * if we have them already, over 'map' if it isn't NULL, or reading
+ * them. Returns 1 if we can't read them. Disk threads may use it with
+ * a mapping of their own.
+ **********************************************************************/
+static int hashRange( tr_io_t * io, tr_map_t * map, uint8_t * data,
+                      uint64_t offset, int size, tr_sha1_t * sha1 )
+{
+    tr_info_t    * inf = &io->tor->info;
+    tr_sha1_t      copy;
+    uint64_t       posInFile, len, left;
+    struct iovec   iov;
+    int            file, ret;
+
+    if( data )
+    {
+        tr_sha1Update( sha1, data, size );
+        return 0;
+    }
+
+    if( map )
+    {
+        copy = *sha1;
+        file = tr_geometryFile( io->tor, offset, &posInFile );
+        for( left = size; left > 0 && file < inf->fileCount; file++ )
+        {
+            len = MIN( left, inf->files[file].length - posInFile );
+            if( len > 0 &&
+                tr_mapHash( map, file, posInFile, len, &copy ) )
+            {
+                break;
+            }
+            left     -= len;
+            posInFile = 0;
+        }
+        if( !left )
+        {
+            *sha1 = copy;
+            return 0;
+        }
+        /* Try the usual way, so we don't miss a piece */
+    }
+
+    iov.iov_base = malloc( size );
+    iov.iov_len  = size;
+    if( !( ret = transferIov( io, offset, &iov, 1, 0, NULL ) ) )
+    {
+        tr_sha1Update( sha1, iov.iov_base, size );
+    }
+    free( iov.iov_base );
+
+    return ret;
+}
+
+/***********************************************************************
+ * fileIov
+ ***********************************************************************
+ * Reads or writes all of 'vec' at 'pos' in a file, retrying on short
+ * transfers. Reading past the end of the file is a failure. 'vec' is
+ * modified.
+ **********************************************************************/
+static int fileIov( int fd, uint64_t pos, struct iovec * vec, int count,
+                    int write )
+{
+    ssize_t ret;
+
+    while( count > 0 )
+    {
+#ifdef SYS_BEOS
+        /* No preadv/pwritev, one buffer at a time */
+        if( write )
+        {
+            ret = pwrite( fd, vec->iov_base, vec->iov_len, pos );
+        }
+        else
+        {
+            ret = pread( fd, vec->iov_base, vec->iov_len, pos );
+        }
+#else
+        if( write )
+        {
+            ret = pwritev( fd, vec, MIN( count, IOV_MAX ), pos );
+        }
+        else
+        {
+            ret = preadv( fd, vec, MIN( count, IOV_MAX ), pos );
+        }
+#endif
+        if( ret < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( ret <= 0 )
+        {
+            return 1;
+        }
+        pos += ret;
+
+        /* Skip what is done */
+        while( count > 0 && (size_t) ret >= vec->iov_len )
+        {
+            ret -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if( count > 0 )
+        {
+            vec->iov_base  = (char *) vec->iov_base + ret;
+            vec->iov_len  -= ret;
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************
+ * directAligned
+ ***********************************************************************
+ * O_DIRECT wants the position in the file, the buffers and their sizes
+ * to be multiples of the block size of the device
+ **********************************************************************/
+static int directAligned( uint64_t pos, struct iovec * iov, int count )
+{
+    int i;
+
+    if( pos % DIRECT_ALIGN )
+    {
+        return 0;
+    }
+    for( i = 0; i < count; i++ )
+    {
+        if( (uintptr_t) iov[i].iov_base % DIRECT_ALIGN ||
+            iov[i].iov_len % DIRECT_ALIGN )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/***********************************************************************
+ * allocBuffer
+ ***********************************************************************
+ * Buffers for the reads that may use O_DIRECT
+ **********************************************************************/
+static void * allocBuffer( tr_io_t * io, int size )
+{
+#ifdef O_DIRECT
+    void * buf;
+
+    if( io->tor->directIO && !io->noDirect )
+    {
+        return posix_memalign( &buf, DIRECT_ALIGN, size ) ? NULL : buf;
+    }
+#endif
+
+    return malloc( size );
+}
+
+/***********************************************************************
+ * adviseRange
+ ***********************************************************************
+ * Tells the system how we are going to use 'size' bytes at 'offset' in
+ * the torrent, with posix_fadvise() where it exists
+ **********************************************************************/
+static void adviseRange( tr_io_t * io, uint64_t offset, uint64_t size,
+                         int advice )
+{
+#ifdef POSIX_FADV_NORMAL
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+    uint64_t       posInFile, len;
+    int            file, fd;
+
+    file = tr_geometryFile( tor, offset, &posInFile );
+    for( ; size > 0 && file < inf->fileCount; file++, posInFile = 0 )
+    {
+        len = MIN( size, inf->files[file].length - posInFile );
+        if( len > 0 &&
+            ( fd = tr_fdFileOpen( tor->fdlimit, io->paths[file],
+                  tor->blockHaveCount < tor->blockCount ?
+                  TR_FD_WRITE : 0 ) ) > -1 )
+        {
+            posix_fadvise( fd, posInFile, len, advice );
+            tr_fdFileRelease( tor->fdlimit, fd );
+        }
+        size -= len;
+    }
+#endif
+}
+
+/***********************************************************************
+ * cacheBlock
+ ***********************************************************************
+ * Keeps a copy of a block we just got in memory. Returns 0 if it did,
+ * or 1 if the block should go to the disk right away, because it isn't
+ * a whole block or we can't make room for it: when the cache is full,
+ * we write the pieces of this torrent we haven't updated for the
+ * longest time.
+ **********************************************************************/
+static int cacheBlock( tr_io_t * io, int index, int begin, int length,
+                       uint8_t * buf )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_cached_t  * cached;
+
+    int block, b, c, i, oldest;
+
+    block = tr_block( index, begin );
+    b     = block - tr_pieceStartBlock( index );
+    c     = findCached( io, index );
+
+    if( tr_blockPosInPiece( block ) != begin ||
+        tr_blockSize( block ) != length )
+    {
+        if( c > -1 )
+        {
+            flushCached( io, c );
+            dropCached( io, c );
+        }
+        return 1;
+    }
+
+    if( c > -1 && io->cached[c].blocks[b] )
+    {
+        /* Already there, overwrite it */
+        cached = &io->cached[c];
+        memcpy( cached->blocks[b], buf, length );
+        if( b < cached->hashed )
+        {
+            tr_sha1Init( &cached->sha1 );
+            cached->hashed = 0;
+            hashBlocks( io, c );
+        }
+        return 0;
+    }
+
+    while( tr_cacheReserve( tor->cache, length ) )
+    {
+        /* No room left, write our oldest piece */
+        oldest = -1;
+        for( i = 0; i < io->cachedCount; i++ )
+        {
+            if( io->cached[i].count > 0 && ( oldest < 0 ||
+                io->cached[i].date < io->cached[oldest].date ) )
+            {
+                oldest = i;
+            }
+        }
+        if( oldest < 0 )
+        {
+            /* Other torrents use it all. We can still hash the block
+               if it comes in order */
+            if( c > -1 && b == io->cached[c].hashed )
+            {
+                tr_sha1Update( &io->cached[c].sha1, buf, length );
+                io->cached[c].hashed++;
+                hashBlocks( io, c );
+            }
+            return 1;
+        }
+        flushCached( io, oldest );
+        tr_cacheFlushed( tor->cache );
+    }
+
+    if( c < 0 )
+    {
+        c = io->cachedCount;
+        io->cachedCount++;
+        io->cached = realloc( io->cached,
+                              io->cachedCount * sizeof( tr_cached_t ) );
+        cached         = &io->cached[c];
+        cached->piece  = index;
+        cached->count  = 0;
+        cached->blocks = calloc( tr_pieceCountBlocks( index ),
+                                 sizeof( uint8_t * ) );
+        cached->hashed = 0;
+        tr_sha1Init( &cached->sha1 );
+    }
+
+    cached            = &io->cached[c];
+    cached->date      = tr_date();
+    cached->blocks[b] = tr_uringAlloc( length );
+    memcpy( cached->blocks[b], buf, length );
+    cached->count++;
+
+    hashBlocks( io, c );
+
+    return 0;
+}
+
+/***********************************************************************
+ * findCached
+ ***********************************************************************
+ * Returns where 'piece' is in io->cached, or -1
+ **********************************************************************/
+static int findCached( tr_io_t * io, int piece )
+{
+    int i;
+
+    for( i = 0; i < io->cachedCount; i++ )
+    {
+        if( io->cached[i].piece == piece )
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/***********************************************************************
+ * hashBlocks
+ ***********************************************************************
+ * Adds to the hash of the c-th cached piece the blocks that follow
+ * what we hashed so far, until we miss one
+ **********************************************************************/
+static void hashBlocks( tr_io_t * io, int c )
+{
+    tr_torrent_t * tor    = io->tor;
+    tr_cached_t  * cached = &io->cached[c];
+
+    int count, start;
+
+    count = tr_pieceCountBlocks( cached->piece );
+    start = tr_pieceStartBlock( cached->piece );
+    while( cached->hashed < count && cached->blocks[cached->hashed] )
+    {
+        tr_sha1Update( &cached->sha1, cached->blocks[cached->hashed],
+                       tr_blockSize( start + cached->hashed ) );
+        cached->hashed++;
+    }
+}
+
+/***********************************************************************
+ * blockRanges
+ ***********************************************************************
+ * Fills 'ranges' with a range for each run of contiguous blocks we
+ * hold of a piece, which is at 'offset' in the torrent, and returns
+ * how many there are. Block n of the piece uses iov[n].
+ **********************************************************************/
+static int blockRanges( tr_io_t * io, int piece, uint8_t ** blocks,
+                        uint64_t offset, struct iovec * iov,
+                        tr_range_t * ranges )
+{
+    tr_torrent_t * tor = io->tor;
+
+    int i, j, n, count, start;
+
+    count = tr_pieceCountBlocks( piece );
+    start = tr_pieceStartBlock( piece );
+
+    for( i = 0, n = 0; i < count; i = j )
+    {
+        if( !blocks[i] )
+        {
+            j = i + 1;
+            continue;
+        }
+        for( j = i; j < count && blocks[j]; j++ )
+        {
+            iov[j].iov_base = blocks[j];
+            iov[j].iov_len  = tr_blockSize( start + j );
+        }
+        ranges[n].offset = offset +
+            (uint64_t) tr_blockPosInPiece( start + i );
+        ranges[n].iov    = &iov[i];
+        ranges[n].count  = j - i;
+        n++;
+    }
+
+    return n;
+}
+
+/***********************************************************************
+ * flushCached
+ ***********************************************************************
+ * Writes the blocks of the c-th cached piece, all runs of contiguous
+ * blocks at once, and frees them. We keep what we hashed. If a write
+ * fails, the blocks will have to be downloaded again.
+ **********************************************************************/
+static int flushCached( tr_io_t * io, int c )
+{
+    tr_torrent_t * tor    = io->tor;
+    tr_info_t    * inf    = &tor->info;
+    tr_cached_t  * cached = &io->cached[c];
+
+    int            i, j, k, n, count, start, ret = 0;
+    struct iovec * iov;
+    tr_range_t   * ranges;
+
+    count  = tr_pieceCountBlocks( cached->piece );
+    start  = tr_pieceStartBlock( cached->piece );
+    iov    = malloc( count * sizeof( struct iovec ) );
+    ranges = malloc( count * sizeof( tr_range_t ) );
+
+    n = blockRanges( io, cached->piece, cached->blocks,
+                     (uint64_t) io->pieceSlot[cached->piece] *
+                     (uint64_t) inf->pieceSize, iov, ranges );
+    if( transferRanges( io, ranges, n, 1, io->map ) )
+    {
+        tr_err( "Piece %d: write failed", cached->piece );
+        for( k = 0; k < n; k++ )
+        {
+            if( !ranges[k].ret )
+            {
+                continue;
+            }
+            i = ranges[k].iov - iov;
+            for( j = i; j < i + ranges[k].count; j++ )
+            {
+                tor->blockHave[start + j] = 0;
+                tor->blockHaveCount      -= 1;
+            }
+        }
+        ret = 1;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        if( cached->blocks[i] )
+        {
+            tr_cacheRelease( tor->cache, tr_blockSize( start + i ) );
+            tr_uringFree( cached->blocks[i] );
+            cached->blocks[i] = NULL;
+        }
+    }
+    free( iov );
+    free( ranges );
+    cached->count = 0;
+
+    if( ret )
+    {
+        /* Start the hash over once we get them again */
+        tr_sha1Init( &cached->sha1 );
+        cached->hashed = 0;
+    }
+
+    return ret;
+}
+
+/***********************************************************************
+ * dropCached
+ ***********************************************************************
+ * Forgets about the c-th cached piece, without writing its blocks
+ **********************************************************************/
+static void dropCached( tr_io_t * io, int c )
+{
+    tr_torrent_t * tor    = io->tor;
+    tr_cached_t  * cached = &io->cached[c];
+
+    int i, count;
+
+    count = tr_pieceCountBlocks( cached->piece );
+    for( i = 0; i < count; i++ )
+    {
+        if( cached->blocks[i] )
+        {
+            tr_cacheRelease( tor->cache,
+                tr_blockSize( tr_pieceStartBlock( cached->piece ) + i ) );
+            tr_uringFree( cached->blocks[i] );
+        }
+    }
+    free( cached->blocks );
+
+    io->cachedCount--;
+    io->cached[c] = io->cached[io->cachedCount];
+}
+
+/***********************************************************************
+ * readPiece
+ ***********************************************************************
+ * Serves reads from the read cache. On a miss, the whole piece is read
+ * to it: by a disk thread if 'wait' isn't set, in which case we return
+ * 2, or right now.
+ **********************************************************************/
+static int readPiece( tr_io_t * io, int index, int begin, int length,
+                      char * buf, int wait )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+    uint64_t       offset;
+    uint8_t      * pieceBuf;
+
+    if( !tr_cacheRead( tor->cache, tor, index, begin, length,
+                       (uint8_t *) buf ) )
+    {
+        return 0;
+    }
+
+    if( !wait && !loadPiece( io, index, 0 ) )
+    {
+        return 2;
+    }
+
+    offset = (uint64_t) io->pieceSlot[index] * (uint64_t) inf->pieceSize;
+
+    if( begin + length > tr_pieceSize( index ) ||
+        !tr_cacheWants( tor->cache, tor, index, tr_pieceSize( index ) ) )
+    {
+        return readBytes( io, offset + (uint64_t) begin, length, buf );
+    }
+
+    /* Read the whole piece at once, the peer will likely ask for the
+       rest of it and other peers may want it too */
+    pieceBuf = malloc( tr_pieceSize( index ) );
+    if( readBytes( io, offset, tr_pieceSize( index ), (char *) pieceBuf ) )
+    {
+        free( pieceBuf );
+        return 1;
+    }
+    memcpy( buf, &pieceBuf[begin], length );
+    tr_cacheAdd( tor->cache, tor, index, pieceBuf, tr_pieceSize( index ),
+                 0 );
+
+    return 0;
+}
+
+/***********************************************************************
+ * loadPiece
+ ***********************************************************************
+ * Has a disk thread read a piece we have to the read cache. Returns 0
+ * if it is on its way, 1 if it won't be.
+ **********************************************************************/
+static int loadPiece( tr_io_t * io, int index, int prefetch )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+    tr_loadjob_t * job;
+
+    if( tr_bitfieldHas( io->loading, index ) )
+    {
+        return 0;
+    }
+    if( !tr_cacheWants( tor->cache, tor, index, tr_pieceSize( index ) ) )
+    {
+        return 1;
+    }
+
+    job           = malloc( sizeof( tr_loadjob_t ) );
+    job->io       = io;
+    job->piece    = index;
+    job->offset   = (uint64_t) io->pieceSlot[index] *
+                    (uint64_t) inf->pieceSize;
+    job->size     = tr_pieceSize( index );
+    job->prefetch = prefetch;
+    if( tr_diskQueue( tor->disk, io, loadWork, loadDone, job ) )
+    {
+        free( job );
+        return 1;
+    }
+    tr_bitfieldAdd( io->loading, index );
+
+    return 0;
+}
+
+/***********************************************************************
+ * loadWork
+ ***********************************************************************
+ * Disk thread side of loadPiece. The read cache holds the piece from
+ * now on, so it shouldn't stay in the system cache as well.
+ **********************************************************************/
+static void loadWork( void * _job )
+{
+    tr_loadjob_t * job = _job;
+    tr_torrent_t * tor = job->io->tor;
+    struct iovec   iov;
+
+    iov.iov_base = allocBuffer( job->io, job->size );
+    iov.iov_len  = job->size;
+    if( !iov.iov_base )
+    {
+        /* loadDone lets the peers read it themselves */
+        return;
+    }
+    if( transferIov( job->io, job->offset, &iov, 1, IO_DIRECT, NULL ) )
+    {
+        free( iov.iov_base );
+        return;
+    }
+    tr_cacheAdd( tor->cache, tor, job->piece, iov.iov_base, job->size,
+                 job->prefetch );
+
+    /* We have it in memory now, the system doesn't need to */
+    adviseRange( job->io, job->offset, job->size, POSIX_FADV_DONTNEED );
+}
+
+static void loadDone( void * _job )
+{
+    tr_loadjob_t * job = _job;
+
+    tr_bitfieldRem( job->io->loading, job->piece );
+    free( job );
+}
+
+/***********************************************************************
+ * checkWork
+ ***********************************************************************
+ * Disk thread side of tr_ioWrite: finishes the hash of a complete
+ * piece, reading the blocks we don't hold, and writes the blocks we
+ * hold if it passed, each run of contiguous blocks at once. We don't
+ * touch anything but the job here.
+ **********************************************************************/
+static void checkWork( void * _job )
+{
+    tr_checkjob_t * job = _job;
+    tr_io_t       * io  = job->io;
+    tr_torrent_t  * tor = io->tor;
+    tr_info_t     * inf = &tor->info;
+
+    int            i, n, count, start, size;
+    uint8_t        hash[SHA_DIGEST_LENGTH];
+    uint8_t      * buf = NULL;
+    struct iovec * iov;
+    tr_range_t   * ranges;
+
+    count = tr_pieceCountBlocks( job->piece );
+    start = tr_pieceStartBlock( job->piece );
+    iov   = malloc( count * sizeof( struct iovec ) );
+
+    if( !job->blocks )
+    {
+        /* Everything is on the disk already */
+        job->buf         = malloc( job->size );
+        iov[0].iov_base  = job->buf;
+        iov[0].iov_len   = job->size;
+        if( !( job->failed = transferIov( io, job->offset, iov, 1, 0,
+                                          NULL ) ) )
+        {
+            SHA1( job->buf, job->size, hash );
+            job->failed = memcmp( hash, &inf->pieces[20*job->piece],
+                                  SHA_DIGEST_LENGTH );
+        }
+        free( iov );
+        return;
+    }
+
+    /* Finish the hash. Blocks we wrote early to make room are read
+       back */
+    job->fromMemory = 1;
+    for( i = job->hashed; i < count && !job->failed; i++ )
+    {
+        size = tr_blockSize( start + i );
+        if( job->blocks[i] )
+        {
+            tr_sha1Update( &job->sha1, job->blocks[i], size );
+            continue;
+        }
+        if( !buf )
+        {
+            buf = malloc( tor->blockSize );
+        }
+        iov[0].iov_base = buf;
+        iov[0].iov_len  = size;
+        job->failed     = transferIov( io, job->offset +
+            (uint64_t) tr_blockPosInPiece( start + i ), iov, 1, 0, NULL );
+        tr_sha1Update( &job->sha1, buf, size );
+        job->fromMemory = 0;
+    }
+    free( buf );
+    tr_sha1Final( &job->sha1, hash );
+    if( !job->failed )
+    {
+        job->failed = memcmp( hash, &inf->pieces[20*job->piece],
+                              SHA_DIGEST_LENGTH );
+    }
+
+    if( job->failed || job->wantBuf )
+    {
+        /* The smart ban needs the whole piece */
+        job->buf = malloc( job->size );
+        for( i = 0; i < count && job->blocks[i]; i++ );
+        if( i < count )
+        {
+            iov[0].iov_base = job->buf;
+            iov[0].iov_len  = job->size;
+            transferIov( io, job->offset, iov, 1, 0, NULL );
+        }
+        for( i = 0; i < count; i++ )
+        {
+            if( job->blocks[i] )
+            {
+                memcpy( &job->buf[tr_blockPosInPiece( start + i )],
+                        job->blocks[i], tr_blockSize( start + i ) );
+            }
+        }
+    }
+
+    /* Write what passed */
+    if( !job->failed )
+    {
+        ranges   = malloc( count * sizeof( tr_range_t ) );
+        n        = blockRanges( io, job->piece, job->blocks, job->offset,
+                                iov, ranges );
+        job->ret = transferRanges( io, ranges, n, 1, NULL );
+        free( ranges );
+    }
+    free( iov );
+
+    for( i = 0; i < count; i++ )
+    {
+        if( job->blocks[i] )
+        {
+            tr_cacheRelease( tor->cache, tr_blockSize( start + i ) );
+            tr_uringFree( job->blocks[i] );
+        }
+    }
+    free( job->blocks );
+}
+
+/***********************************************************************
+ * checkDone
+ ***********************************************************************
+ * Torrent thread side of tr_ioWrite
+ **********************************************************************/
+static void checkDone( void * _job )
+{
+    tr_checkjob_t * job = _job;
+    tr_io_t       * io  = job->io;
+    tr_torrent_t  * tor = io->tor;
+
+    int i, startBlock, endBlock;
+
+    (io->checking)--;
+    tr_cacheHashed( tor->cache, job->fromMemory );
+
+    startBlock = tr_pieceStartBlock( job->piece );
+    endBlock   = startBlock + tr_pieceCountBlocks( job->piece );
+
+    if( job->failed || job->ret )
+    {
+        if( job->failed )
+        {
+            tr_inf( "Piece %d (slot %d): hash FAILED", job->piece,
+                    io->pieceSlot[job->piece] );
+        }
+        else
+        {
+            tr_err( "Piece %d (slot %d): write failed", job->piece,
+                    io->pieceSlot[job->piece] );
+        }
+
+        /* We will need to reload the whole piece */
+        for( i = startBlock; i < endBlock; i++ )
+        {
+            tor->blockHave[i]    = 0;
+            tor->blockHaveCount -= 1;
+        }
+
+        /* Remember what we got and who sent it */
+        if( job->failed && job->buf )
+        {
+            tr_banPieceFailed( tor->ban, job->piece, job->buf );
+        }
+    }
+    else
+    {
+        tr_inf( "Piece %d (slot %d): hash OK", job->piece,
+                io->pieceSlot[job->piece] );
+        tr_bitfieldAdd( tor->bitfield, job->piece );
+        tr_peerSendHave( tor, job->piece );
+        (io->resumeDirty)++;
+
+        /* Find out who sent us bad data before, if anyone */
+        if( job->buf )
+        {
+            tr_banPiecePassed( tor->ban, job->piece, job->buf );
+        }
+    }
+
+    free( job->buf );
+    free( job );
+}
+
+/***********************************************************************
+ * readSlot
+ ***********************************************************************
+ * 
+ **********************************************************************/
+static int readOrWriteSlot( tr_io_t * io, int slot, uint8_t * buf,
+                            int * size, int write )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
 
     uint64_t offset = (uint64_t) slot * (uint64_t) inf->pieceSize;
     
@@ -497,6 +2119,9 @@ static void invertSlots( tr_io_t * io, int slot1, int slot2 )
     uint8_t * buf1, * buf2;
     int piece1, piece2, foo;
 
+    /* Don't move anything a disk thread is reading or writing */
+    tr_diskWait( tor->disk, io );
+
     buf1 = calloc( inf->pieceSize, 1 );
     buf2 = calloc( inf->pieceSize, 1 );
 
@@ -513,8 +2138,14 @@ static void invertSlots( tr_io_t * io, int slot1, int slot2 )
     piece2                = io->slotPiece[slot2];
     io->slotPiece[slot1]  = piece2;
     io->slotPiece[slot2]  = piece1;
-    io->pieceSlot[piece1] = slot2;
-    io->pieceSlot[piece2] = slot1;
+    if( piece1 > -1 )
+    {
+        io->pieceSlot[piece1] = slot2;
+    }
+    if( piece2 > -1 )
+    {
+        io->pieceSlot[piece2] = slot1;
+    }
 }
 
 static void reorderPieces( tr_io_t * io )
@@ -555,189 +2186,754 @@ static void reorderPieces( tr_io_t * io )
     } while( didInvert );
 }
 
-static void findSlotForPiece( tr_io_t * io, int piece )
+/***********************************************************************
+ * moveToFinalSlots
+ ***********************************************************************
+ * Full allocation: moves every piece we have started to its own slot,
+ * growing the files if needed, so we never have to look at the slots
+ * tables again
+ **********************************************************************/
+static void moveToFinalSlots( tr_io_t * io )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    int i;
+
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        if( io->pieceSlot[i] > -1 && io->pieceSlot[i] != i )
+        {
+            tr_inf( "invert %d and %d", io->pieceSlot[i], i );
+            invertSlots( io, io->pieceSlot[i], i );
+        }
+    }
+
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        io->pieceSlot[i] = i;
+        io->slotPiece[i] = i;
+    }
+    io->slotsUsed = inf->pieceCount;
+}
+
+static void findSlotForPiece( tr_io_t * io, int piece )
+{
+    int i;
+#if 0
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    tr_dbg( "Entering findSlotForPiece" );
+
+    for( i = 0; i < inf->pieceCount; i++ )
+        printf( "%02d ", io->slotPiece[i] );
+    printf( "\n" );
+    for( i = 0; i < inf->pieceCount; i++ )
+        printf( "%02d ", io->pieceSlot[i] );
+    printf( "\n" );
+#endif
+
+    /* Look for an empty slot somewhere */
+    for( i = 0; i < io->slotsUsed; i++ )
+    {
+        if( io->slotPiece[i] < 0 )
+        {
+            io->pieceSlot[piece] = i;
+            io->slotPiece[i]     = piece;
+            goto reorder;
+        }
+    }
+
+    /* No empty slot, extend the file */
+    io->pieceSlot[piece]         = io->slotsUsed;
+    io->slotPiece[io->slotsUsed] = piece;
+    (io->slotsUsed)++;
+
+  reorder:
+    reorderPieces( io );
+
+#if 0
+    for( i = 0; i < inf->pieceCount; i++ )
+        printf( "%02d ", io->slotPiece[i] );
+    printf( "\n" );
+    for( i = 0; i < inf->pieceCount; i++ )
+        printf( "%02d ", io->pieceSlot[i] );
+    printf( "\n" );
+
+    printf( "Leaving findSlotForPiece\n" );
+#endif
+}
+
+/***********************************************************************
+ * Fast resume
+ ***********************************************************************
+ * Format of the resume file, version 1. All numbers are big endian:
+ *  - 4 bytes: format version (1)
+ *  - 4 bytes: flags, RESUME_RUNNING if it was saved while downloading
+ *  - 4 bytes each: number of files, pieces and blocks
+ *  - 8 + 8 bytes * number of files: size and mtime of each file
+ *  - 1 bit * number of blocks: whether we have the block or not
+ *  - 4 bytes * number of pieces: the piece that has been completed or
+ *    started in each slot, -1 if none
+ *  - 20 bytes: SHA1 of all the above
+ *
+ * The file is written to a temporary file, then renamed, so we never
+ * leave a half-written one behind. It is saved when the torrent is
+ * stopped, and every RESUME_PIECES completed pieces or RESUME_INTERVAL
+ * milliseconds while downloading, by a disk thread.
+ *
+ * Version 0 files are still read. They have a 4 bytes version (0),
+ * 4 bytes mtimes, the same bitfield and slots table, all in the native
+ * endianness and without a checksum.
+ *
+ * When a file changed since the resume file was saved, we only check
+ * again the slots over it (see fastResumeRecheck).
+ *
+ * The resume file is located in ~/.transmission. Its name is
+ * "resume.<info hash>".
+ **********************************************************************/
+#define RESUME_RUNNING 1
+
+/* Several threads may save at the same time, so these fill buffers of
+   MAX_PATH_LENGTH bytes we give them */
+static char * fastResumeFolderName( char * folderName )
+{
+    snprintf( folderName, MAX_PATH_LENGTH, "%s/.transmission",
+              getenv( "HOME" ) );
+
+    return folderName;
+}
+
+static char * fastResumeFileName( tr_io_t * io, char * fileName )
+{
+    char   folderName[MAX_PATH_LENGTH];
+    char * p;
+    int    i;
+
+    snprintf( fileName, MAX_PATH_LENGTH - 2 * SHA_DIGEST_LENGTH,
+              "%s/resume.", fastResumeFolderName( folderName ) );
+    p = &fileName[ strlen( fileName ) ];
+    for( i = 0; i < SHA_DIGEST_LENGTH; i++ )
+    {
+        sprintf( p, "%02x", io->tor->info.hash[i] );
+        p += 2;
+    }
+
+    return fileName;
+}
+
+static void resumePut32( uint8_t * p, uint32_t a )
+{
+    p[0] = a >> 24;
+    p[1] = a >> 16;
+    p[2] = a >> 8;
+    p[3] = a;
+}
+
+static uint32_t resumeGet32( uint8_t * p )
+{
+    return ( (uint32_t) p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) |
+           p[3];
+}
+
+static void resumePut64( uint8_t * p, uint64_t a )
+{
+    resumePut32( p,     a >> 32 );
+    resumePut32( p + 4, a );
+}
+
+static uint64_t resumeGet64( uint8_t * p )
+{
+    return ( (uint64_t) resumeGet32( p ) << 32 ) | resumeGet32( p + 4 );
+}
+
+/***********************************************************************
+ * fastResumeStat
+ ***********************************************************************
+ * Writes the size and mtime of each file in 'tab', 16 bytes per file,
+ * as stored in version 1 files
+ **********************************************************************/
+static int fastResumeStat( tr_io_t * io, uint8_t * tab )
+{
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
+
+    int           i;
+    char        * path;
+    struct stat   sb;
+
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        asprintf( &path, "%s/%s", tor->destination, inf->files[i].name );
+        if( stat( path, &sb ) )
+        {
+            tr_err( "Could not stat '%s'", path );
+            free( path );
+            return 1;
+        }
+        if( ( sb.st_mode & S_IFMT ) != S_IFREG )
+        {
+            tr_err( "Wrong st_mode for '%s'", path );
+            free( path );
+            return 1;
+        }
+        free( path );
+
+        resumePut64( &tab[16*i], sb.st_size );
+#ifdef SYS_DARWIN
+        resumePut64( &tab[16*i+8], sb.st_mtimespec.tv_sec );
+#else
+        resumePut64( &tab[16*i+8], sb.st_mtime );
+#endif
+    }
+
+    return 0;
+}
+
+/***********************************************************************
+ * fastResumeMTimes
+ ***********************************************************************
+ * Same as above for version 0 files: 4 bytes mtimes, native endianness
+ **********************************************************************/
+static int fastResumeMTimes( tr_io_t * io, int * tab )
+{
+    tr_info_t * inf = &io->tor->info;
+    uint8_t   * stats;
+    int         i;
+
+    stats = malloc( 16 * inf->fileCount );
+    if( fastResumeStat( io, stats ) )
+    {
+        free( stats );
+        return 1;
+    }
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        tab[i] = resumeGet64( &stats[16*i+8] ) & 0x7FFFFFFF;
+    }
+    free( stats );
+
+    return 0;
+}
+
+/***********************************************************************
+ * fastResumeBuild
+ ***********************************************************************
+ * Puts everything but the file sizes and mtimes and the checksum in a
+ * buffer, for fastResumeWork to complete and write. While the torrent
+ * is running, blocks we only hold in memory and complete pieces not
+ * checked yet are left out: only what is on the disk is saved.
+ **********************************************************************/
+static tr_resumejob_t * fastResumeBuild( tr_io_t * io, int running )
+{
+    tr_torrent_t   * tor = io->tor;
+    tr_info_t      * inf = &tor->info;
+    tr_resumejob_t * job;
+
+    uint8_t * p, * blockBitfield;
+    int       i, j, start, end;
+
+    job       = malloc( sizeof( tr_resumejob_t ) );
+    job->io   = io;
+    job->size = 20 + 16 * inf->fileCount + ( tor->blockCount + 7 ) / 8 +
+                4 * inf->pieceCount + SHA_DIGEST_LENGTH;
+    job->buf  = calloc( job->size, 1 );
+
+    p = job->buf;
+    resumePut32( &p[0],  1 );
+    resumePut32( &p[4],  running ? RESUME_RUNNING : 0 );
+    resumePut32( &p[8],  inf->fileCount );
+    resumePut32( &p[12], inf->pieceCount );
+    resumePut32( &p[16], tor->blockCount );
+    p += 20 + 16 * inf->fileCount;
+
+    /* The bitfield for blocks */
+    blockBitfield = p;
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        start = tr_pieceStartBlock( i );
+        end   = start + tr_pieceCountBlocks( i );
+
+        if( !tr_bitfieldHas( tor->bitfield, i ) )
+        {
+            if( findCached( io, i ) > -1 )
+            {
+                /* Not written yet */
+                continue;
+            }
+            for( j = start; j < end && tor->blockHave[j] < 0; j++ );
+            if( j >= end )
+            {
+                /* Complete, a disk thread is checking and writing it */
+                continue;
+            }
+        }
+
+        for( j = start; j < end; j++ )
+        {
+            if( tor->blockHave[j] < 0 )
+            {
+                tr_bitfieldAdd( blockBitfield, j );
+            }
+        }
+    }
+    p += ( tor->blockCount + 7 ) / 8;
+
+    /* The 'slotPiece' table */
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        resumePut32( &p[4*i], io->slotPiece[i] );
+    }
+
+    return job;
+}
+
+/***********************************************************************
+ * fastResumeWork
+ ***********************************************************************
+ * Completes the buffer and writes it. Called from a disk thread for
+ * the saves while running.
+ **********************************************************************/
+static void fastResumeWork( void * _job )
+{
+    tr_resumejob_t * job = _job;
+    tr_io_t        * io  = job->io;
+
+    FILE    * file;
+    char      path[MAX_PATH_LENGTH], tmp[MAX_PATH_LENGTH + 4];
+    int       ok, fd;
+    tr_sha1_t sha1;
+
+    if( fastResumeStat( io, &job->buf[20] ) )
+    {
+        return;
+    }
+    tr_sha1Init( &sha1 );
+    tr_sha1Update( &sha1, job->buf, job->size - SHA_DIGEST_LENGTH );
+    tr_sha1Final( &sha1, &job->buf[job->size - SHA_DIGEST_LENGTH] );
+
+    /* Create folder if missing */
+    mkdir( fastResumeFolderName( path ), 0755 );
+
+    fastResumeFileName( io, path );
+    snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+    if( !( file = fopen( tmp, "w" ) ) )
+    {
+        tr_err( "Could not open '%s' for writing", tmp );
+        return;
+    }
+
+    /* Only replace the old file once the new one is on the disk */
+    ok = ( fwrite( job->buf, job->size, 1, file ) == 1 &&
+           !fflush( file ) && !fsync( fileno( file ) ) );
+    if( fclose( file ) || !ok || rename( tmp, path ) )
+    {
+        tr_err( "Could not write '%s' (%s)", path, strerror( errno ) );
+        unlink( tmp );
+        return;
+    }
+
+    /* Make the rename itself survive a crash */
+    if( ( fd = open( fastResumeFolderName( path ), O_RDONLY ) ) > -1 )
+    {
+        fsync( fd );
+        close( fd );
+    }
+}
+
+static void fastResumeDone( void * _job )
+{
+    tr_resumejob_t * job = _job;
+
+    job->io->resumeSaving = 0;
+    free( job->buf );
+    free( job );
+}
+
+/***********************************************************************
+ * fastResumeSave
+ ***********************************************************************
+ * Saves right away, once the torrent is stopped
+ **********************************************************************/
+static void fastResumeSave( tr_io_t * io )
+{
+    tr_resumejob_t * job;
+
+    job = fastResumeBuild( io, 0 );
+    fastResumeWork( job );
+    fastResumeDone( job );
+}
+
+/***********************************************************************
+ * fastResumeCheckpoint
+ ***********************************************************************
+ * While downloading, has a disk thread save the resume file every
+ * RESUME_PIECES completed pieces, or RESUME_INTERVAL milliseconds
+ * after we completed one
+ **********************************************************************/
+static void fastResumeCheckpoint( tr_io_t * io )
+{
+    tr_resumejob_t * job;
+
+    if( io->resumeSaving || io->resumeDirty < 1 ||
+        ( io->resumeDirty < RESUME_PIECES &&
+          tr_date() < io->resumeDate + RESUME_INTERVAL ) )
+    {
+        return;
+    }
+
+    /* Don't build it for nothing, it goes through all the blocks */
+    if( tr_diskFull( io->tor->disk ) )
+    {
+        return;
+    }
+
+    job = fastResumeBuild( io, 1 );
+    if( tr_diskQueue( io->tor->disk, io, fastResumeWork, fastResumeDone,
+                      job ) )
+    {
+        /* Try again next time */
+        free( job->buf );
+        free( job );
+        return;
+    }
+    io->resumeSaving = 1;
+    io->resumeDirty  = 0;
+    io->resumeDate   = tr_date();
+}
+
+/***********************************************************************
+ * fastResumeLoadV0
+ ***********************************************************************
+ * Checks a version 0 file, fills slotPiece from it, points
+ * 'blockBitfield' to its bitfield for blocks and sets 'changed' for the
+ * files whose mtime changed since it was saved
+ **********************************************************************/
+static int fastResumeLoadV0( tr_io_t * io, uint8_t * buf, int size,
+                             uint8_t ** blockBitfield, char * changed )
 {
-    int i;
-#if 0
     tr_torrent_t * tor = io->tor;
     tr_info_t    * inf = &tor->info;
 
-    tr_dbg( "Entering findSlotForPiece" );
-
-    for( i = 0; i < inf->pieceCount; i++ )
-        printf( "%02d ", io->slotPiece[i] );
-    printf( "\n" );
-    for( i = 0; i < inf->pieceCount; i++ )
-        printf( "%02d ", io->pieceSlot[i] );
-    printf( "\n" );
-#endif
+    int * fileMTimes;
+    int   i, expected;
 
-    /* Look for an empty slot somewhere */
-    for( i = 0; i < io->slotsUsed; i++ )
+    /* Check the size */
+    expected = 4 + 4 * inf->fileCount + 4 * inf->pieceCount +
+        ( tor->blockCount + 7 ) / 8;
+    if( size != expected )
     {
-        if( io->slotPiece[i] < 0 )
-        {
-            io->pieceSlot[piece] = i;
-            io->slotPiece[i]     = piece;
-            goto reorder;
-        }
+        tr_inf( "Wrong size for resume file (%d bytes, %d expected)",
+                size, expected );
+        return 1;
     }
+    buf += 4;
 
-    /* No empty slot, extend the file */
-    io->pieceSlot[piece]         = io->slotsUsed;
-    io->slotPiece[io->slotsUsed] = piece;
-    (io->slotsUsed)++;
+    /* Compare file mtimes */
+    fileMTimes = malloc( inf->fileCount * 4 );
+    if( fastResumeMTimes( io, fileMTimes ) )
+    {
+        free( fileMTimes );
+        return 1;
+    }
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        changed[i] = !!memcmp( &fileMTimes[i], &buf[4*i], 4 );
+    }
+    free( fileMTimes );
+    buf += inf->fileCount * 4;
 
-  reorder:
-    reorderPieces( io );
+    *blockBitfield = buf;
+    buf += ( tor->blockCount + 7 ) / 8;
 
-#if 0
-    for( i = 0; i < inf->pieceCount; i++ )
-        printf( "%02d ", io->slotPiece[i] );
-    printf( "\n" );
-    for( i = 0; i < inf->pieceCount; i++ )
-        printf( "%02d ", io->pieceSlot[i] );
-    printf( "\n" );
+    /* Load the 'slotPiece' table */
+    memcpy( io->slotPiece, buf, inf->pieceCount * 4 );
 
-    printf( "Leaving findSlotForPiece\n" );
-#endif
+    return 0;
 }
 
 /***********************************************************************
- * Fast resume
+ * fastResumeLoadV1
  ***********************************************************************
- * Format of the resume file:
- *  - 4 bytes: format version (currently 0)
- *  - 4 bytes * number of files: mtimes of files
- *  - 1 byte * number of blocks: whether we have the block or not
- *  - 4 bytes * number of pieces: the pieces that has been completed or
- *    started in each slot
- *
- * The resume file is located in the same folder we are downloading to.
- * Its name is ".libtransmission.<inf->name>".
- *
- * All values are stored in the native endianness. It is not safe to
- * move a libtransmission resume file from an architecture to another.
+ * Same as above for a version 1 file, which also has the sizes of the
+ * files. Sets 'running' if it was saved while downloading.
  **********************************************************************/
-static char * fastResumeFolderName()
+static int fastResumeLoadV1( tr_io_t * io, uint8_t * buf, int size,
+                             uint8_t ** blockBitfield, char * changed,
+                             int * running )
 {
-    static char folderName[MAX_PATH_LENGTH];
+    tr_torrent_t * tor = io->tor;
+    tr_info_t    * inf = &tor->info;
 
-    snprintf( folderName, MAX_PATH_LENGTH, "%s/.transmission",
-              getenv( "HOME" ) );
+    uint8_t * p, * stats, hash[SHA_DIGEST_LENGTH];
+    tr_sha1_t sha1;
+    int       i, expected;
 
-    return folderName;
-}
+    expected = 20 + 16 * inf->fileCount + ( tor->blockCount + 7 ) / 8 +
+               4 * inf->pieceCount + SHA_DIGEST_LENGTH;
+    if( size != expected ||
+        resumeGet32( &buf[8] )  != (uint32_t) inf->fileCount ||
+        resumeGet32( &buf[12] ) != (uint32_t) inf->pieceCount ||
+        resumeGet32( &buf[16] ) != (uint32_t) tor->blockCount )
+    {
+        tr_inf( "Resume file doesn't match the torrent" );
+        return 1;
+    }
 
-static char * fastResumeFileName( tr_io_t * io )
-{
-    static char   fileName[MAX_PATH_LENGTH];
-    char        * p;
-    int           i;
+    tr_sha1Init( &sha1 );
+    tr_sha1Update( &sha1, buf, size - SHA_DIGEST_LENGTH );
+    tr_sha1Final( &sha1, hash );
+    if( memcmp( hash, &buf[size - SHA_DIGEST_LENGTH], SHA_DIGEST_LENGTH ) )
+    {
+        tr_inf( "Resume file is corrupted" );
+        return 1;
+    }
+    *running = resumeGet32( &buf[4] ) & RESUME_RUNNING;
 
-    snprintf( fileName, MAX_PATH_LENGTH, "%s/resume.",
-              fastResumeFolderName() );
-    p = &fileName[ strlen( fileName ) ];
-    for( i = 0; i < SHA_DIGEST_LENGTH; i++ )
+    /* Compare file sizes and mtimes */
+    stats = malloc( 16 * inf->fileCount );
+    if( fastResumeStat( io, stats ) )
     {
-        sprintf( p, "%02x", io->tor->info.hash[i] );
-        p += 2;
+        free( stats );
+        return 1;
+    }
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        changed[i] = !!memcmp( &stats[16*i], &buf[20+16*i], 16 );
     }
+    free( stats );
+    p = &buf[20 + 16 * inf->fileCount];
 
-    return fileName;
+    *blockBitfield = p;
+    p += ( tor->blockCount + 7 ) / 8;
+
+    /* Load the 'slotPiece' table */
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        io->slotPiece[i] = resumeGet32( &p[4*i] );
+    }
+
+    return 0;
 }
 
-static int fastResumeMTimes( tr_io_t * io, int * tab )
+/***********************************************************************
+ * fastResumeRecheck
+ ***********************************************************************
+ * Finds out which slots we can't trust: the ones over files that
+ * changed since the resume file was saved, and if it was saved while
+ * running, the ones whose piece may have been moved since. Complete
+ * pieces there are hashed again, and forgotten if they don't match.
+ * Blocks of incomplete pieces there are kept if we are the ones who
+ * wrote the files since, forgotten otherwise.
+ **********************************************************************/
+static void fastResumeRecheck( tr_io_t * io, char * changed, int running )
 {
     tr_torrent_t * tor = io->tor;
     tr_info_t    * inf = &tor->info;
 
-    int           i;
-    char        * path;
-    struct stat   sb;
+    int        i, j, last, start, piece, files = 0, count = 0;
+    uint64_t   offset;
+    uint8_t  * hash;
+    char     * recheck;
+
+    recheck = calloc( inf->pieceCount, 1 );
 
+    /* Slots over files that changed */
     for( i = 0; i < inf->fileCount; i++ )
     {
-        asprintf( &path, "%s/%s", tor->destination, inf->files[i].name );
-        if( stat( path, &sb ) )
+        if( !changed[i] )
         {
-            tr_err( "Could not stat '%s'", path );
-            free( path );
-            return 1;
+            continue;
         }
-        if( ( sb.st_mode & S_IFMT ) != S_IFREG )
+        files++;
+        if( !inf->files[i].length )
         {
-            tr_err( "Wrong st_mode for '%s'", path );
-            free( path );
-            return 1;
+            continue;
         }
-        free( path );
+        offset = tor->geo.fileOffset[i];
+        last   = ( offset + inf->files[i].length - 1 ) / inf->pieceSize;
+        for( j = offset / inf->pieceSize; j <= last; j++ )
+        {
+            recheck[j] = 1;
+        }
+    }
+    if( files )
+    {
+        tr_inf( "%d file(s) changed since the resume file was saved",
+                files );
+    }
 
-#ifdef SYS_DARWIN
-        tab[i] = ( sb.st_mtimespec.tv_sec & 0x7FFFFFFF );
-#else
-        tab[i] = ( sb.st_mtime & 0x7FFFFFFF );
-#endif
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        piece = io->slotPiece[i];
+        if( piece < 0 )
+        {
+            recheck[i] = 0;
+            continue;
+        }
+        if( running && piece != i )
+        {
+            /* Pieces in their own slot are never moved */
+            recheck[i] = 1;
+        }
+        if( recheck[i] && !tr_bitfieldHas( tor->bitfield, piece ) )
+        {
+            recheck[i] = 0;
+            if( running )
+            {
+                /* Only we wrote there, the blocks will be checked with
+                   the rest of the piece */
+                continue;
+            }
+            start = tr_pieceStartBlock( piece );
+            for( j = start; j < start + tr_pieceCountBlocks( piece ); j++ )
+            {
+                if( tor->blockHave[j] < 0 )
+                {
+                    tor->blockHave[j] = 0;
+                    (tor->blockHaveCount)--;
+                }
+            }
+        }
+        count += recheck[i];
+    }
+    if( !count )
+    {
+        free( recheck );
+        return;
     }
 
-    return 0;
+    tr_inf( "Checking %d pieces again", count );
+    verifySlots( io, recheck );
+
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        if( !recheck[i] )
+        {
+            continue;
+        }
+        piece = io->slotPiece[i];
+        hash  = &io->slotHash[20*i];
+        if( io->slotLastHash && piece == inf->pieceCount - 1 )
+        {
+            hash = &io->slotLastHash[20*i];
+        }
+        if( io->slotRead[i] && !memcmp( hash, &inf->pieces[20*piece],
+                                        SHA_DIGEST_LENGTH ) )
+        {
+            continue;
+        }
+
+        tr_inf( "Piece %d (slot %d) is not there anymore", piece, i );
+        tr_bitfieldRem( tor->bitfield, piece );
+        start = tr_pieceStartBlock( piece );
+        for( j = start; j < start + tr_pieceCountBlocks( piece ); j++ )
+        {
+            tor->blockHave[j] = 0;
+            (tor->blockHaveCount)--;
+        }
+    }
+
+    verifyClose( io );
+    free( recheck );
 }
 
-static void fastResumeSave( tr_io_t * io )
+/***********************************************************************
+ * fastResumeBlocks
+ ***********************************************************************
+ * Fills blockHave from the bitfield for blocks, and tor->bitfield with
+ * the pieces whose blocks are all set. Runs of 64 blocks all set or all
+ * unset, by far the most common, take a single 64-bit compare.
+ **********************************************************************/
+static void fastResumeBlocks( tr_io_t * io, uint8_t * blockBitfield )
 {
     tr_torrent_t * tor = io->tor;
     tr_info_t    * inf = &tor->info;
-    
-    FILE    * file;
-    int       version = 0;
-    char    * path;
-    int     * fileMTimes;
-    int       i;
-    uint8_t * blockBitfield;
 
-    /* Get file sizes */
-    fileMTimes = malloc( inf->fileCount * 4 );
-    if( fastResumeMTimes( io, fileMTimes ) )
+    int      i, j, n, start, count = 0;
+    uint64_t word;
+
+    for( i = 0; i < tor->blockCount; i += 64 )
     {
-        free( fileMTimes );
-        return;
+        n = MIN( 64, tor->blockCount - i );
+        if( n == 64 )
+        {
+            memcpy( &word, &blockBitfield[i/8], 8 );
+            if( !word )
+            {
+                continue;
+            }
+            if( word == ~(uint64_t) 0 )
+            {
+                memset( &tor->blockHave[i], -1, 64 );
+                count += 64;
+                continue;
+            }
+        }
+        for( j = i; j < i + n; j++ )
+        {
+            if( tr_bitfieldHas( blockBitfield, j ) )
+            {
+                tor->blockHave[j] = -1;
+                count++;
+            }
+        }
     }
+    tor->blockHaveCount += count;
 
-    /* Create folder if missing */
-    mkdir( fastResumeFolderName(), 0755 );
-
-    /* Create/overwrite the resume file */
-    path = fastResumeFileName( io );
-    if( !( file = fopen( path, "w" ) ) )
+    for( i = 0, start = 0; i < inf->pieceCount; i++ )
     {
-        tr_err( "Could not open '%s' for writing", path );
-        free( fileMTimes );
-        return;
+        n = tr_pieceCountBlocks( i );
+        if( bitfieldIsFull( blockBitfield, start, start + n ) )
+        {
+            tr_bitfieldAdd( tor->bitfield, i );
+        }
+        start += n;
     }
-    
-    /* Write format version */
-    fwrite( &version, 4, 1, file );
+}
 
-    /* Write file mtimes */
-    fwrite( fileMTimes, 4, inf->fileCount, file );
-    free( fileMTimes );
+/***********************************************************************
+ * bitfieldIsFull
+ ***********************************************************************
+ * Returns 1 if bits 'start' to 'end' - 1 are all set. Whole words, then
+ * whole bytes, are compared at once.
+ **********************************************************************/
+static int bitfieldIsFull( uint8_t * bitfield, int start, int end )
+{
+    uint64_t word;
 
-    /* Build and write the bitfield for blocks */
-    blockBitfield = calloc( ( tor->blockCount + 7 ) / 8, 1 );
-    for( i = 0; i < tor->blockCount; i++ )
+    for( ; start < end && ( start & 7 ); start++ )
     {
-        if( tor->blockHave[i] < 0 )
+        if( !tr_bitfieldHas( bitfield, start ) )
         {
-            tr_bitfieldAdd( blockBitfield, i );
+            return 0;
+        }
+    }
+    for( ; start + 64 <= end; start += 64 )
+    {
+        memcpy( &word, &bitfield[start/8], 8 );
+        if( word != ~(uint64_t) 0 )
+        {
+            return 0;
+        }
+    }
+    for( ; start + 8 <= end; start += 8 )
+    {
+        if( bitfield[start/8] != 0xFF )
+        {
+            return 0;
+        }
+    }
+    for( ; start < end; start++ )
+    {
+        if( !tr_bitfieldHas( bitfield, start ) )
+        {
+            return 0;
         }
     }
-    fwrite( blockBitfield, ( tor->blockCount + 7 ) / 8, 1, file );
-    free( blockBitfield );
-
-    /* Write the 'slotPiece' table */
-    fwrite( io->slotPiece, 4, inf->pieceCount, file );
 
-    fclose( file );
+    return 1;
 }
 
 static int fastResumeLoad( tr_io_t * io )
@@ -745,119 +2941,94 @@ static int fastResumeLoad( tr_io_t * io )
     tr_torrent_t * tor = io->tor;
     tr_info_t    * inf = &tor->info;
     
-    FILE    * file;
-    int       version = 0;
-    char    * path;
-    int     * fileMTimes1, * fileMTimes2;
-    int       i, j;
-    uint8_t * blockBitfield;
-
-    int size;
+    FILE     * file;
+    int        version = -1, running = 0;
+    char       path[MAX_PATH_LENGTH], * changed;
+    int        i, j, size, ret;
+    uint8_t  * buf, * blockBitfield = NULL;
+    uint64_t   date = tr_date();
 
     /* Open resume file */
-    path = fastResumeFileName( io );
+    fastResumeFileName( io, path );
     if( !( file = fopen( path, "r" ) ) )
     {
         tr_inf( "Could not open '%s' for reading", path );
         return 1;
     }
 
-    /* Check the size */
-    size = 4 + 4 * inf->fileCount + 4 * inf->pieceCount +
-        ( tor->blockCount + 7 ) / 8;
+    /* Read it all */
     fseek( file, 0, SEEK_END );
-    if( ftell( file ) != size )
-    {
-        tr_inf( "Wrong size for resume file (%d bytes, %d expected)",
-                ftell( file ), size );
-        fclose( file );
-        return 1;
-    }
+    size = ftell( file );
     fseek( file, 0, SEEK_SET );
-
-    /* Check format version */
-    fread( &version, 4, 1, file );
-    if( version != 0 )
+    buf = malloc( MAX( size, 4 ) );
+    if( size < 4 || fread( buf, size, 1, file ) != 1 )
     {
-        tr_inf( "Resume file has version %d, not supported",
-                version );
+        tr_inf( "Could not read '%s'", path );
+        free( buf );
         fclose( file );
         return 1;
     }
+    fclose( file );
 
-    /* Compare file mtimes */
-    fileMTimes1 = malloc( inf->fileCount * 4 );
-    if( fastResumeMTimes( io, fileMTimes1 ) )
+    /* Check format version */
+    changed = calloc( inf->fileCount, 1 );
+    if( resumeGet32( buf ) == 1 )
     {
-        free( fileMTimes1 );
-        fclose( file );
-        return 1;
+        version = 1;
+        ret     = fastResumeLoadV1( io, buf, size, &blockBitfield,
+                                    changed, &running );
     }
-    fileMTimes2 = malloc( inf->fileCount * 4 );
-    fread( fileMTimes2, 4, inf->fileCount, file );
-    if( memcmp( fileMTimes1, fileMTimes2, inf->fileCount * 4 ) )
+    else if( !*( (int *) buf ) )
     {
-        tr_inf( "File mtimes don't match" );
-        free( fileMTimes1 );
-        free( fileMTimes2 );
-        fclose( file );
-        return 1;
+        version = 0;
+        ret     = fastResumeLoadV0( io, buf, size, &blockBitfield,
+                                    changed );
     }
-    free( fileMTimes1 );
-    free( fileMTimes2 );
-
-    /* Load the bitfield for blocks and fill blockHave */
-    blockBitfield = calloc( ( tor->blockCount + 7 ) / 8, 1 );
-    fread( blockBitfield, ( tor->blockCount + 7 ) / 8, 1, file );
-    for( i = 0; i < tor->blockCount; i++ )
+    else
     {
-        if( tr_bitfieldHas( blockBitfield, i ) )
-        {
-            tor->blockHave[i] = -1;
-            (tor->blockHaveCount)++;
-        }
+        tr_inf( "Resume file has an unknown version" );
+        ret = 1;
     }
-    free( blockBitfield );
 
-    /* Load the 'slotPiece' table */
-    fread( io->slotPiece, 4, inf->pieceCount, file );
-
-    fclose( file );
-
-    /* Update io->pieceSlot, io->slotsUsed, and tor->bitfield */
+    /* Update io->pieceSlot and io->slotsUsed, in one pass over the
+       slots. If a piece is listed twice, the first slot wins */
+    memset( io->pieceSlot, 0xFF, inf->pieceCount * sizeof( int ) );
     io->slotsUsed = 0;
-    for( i = 0; i < inf->pieceCount; i++ )
+    for( i = 0; !ret && i < inf->pieceCount; i++ )
     {
-        io->pieceSlot[i] = -1;
-        for( j = 0; j < inf->pieceCount; j++ )
-        {
-            if( io->slotPiece[j] == i )
-            {
-                tr_dbg( "Has piece %d in slot %d", i, j );
-                io->pieceSlot[i] = j;
-                io->slotsUsed = MAX( io->slotsUsed, j + 1 );
-                break;
-            }
-        }
-
-        for( j = tr_pieceStartBlock( i );
-             j < tr_pieceStartBlock( i ) + tr_pieceCountBlocks( i );
-             j++ )
+        j = io->slotPiece[i];
+        if( j < -1 || j >= inf->pieceCount )
         {
-            if( tor->blockHave[j] > -1 )
-            {
-                break;
-            }
+            tr_inf( "Resume file has a bad slot table" );
+            ret = 1;
         }
-        if( j >= tr_pieceStartBlock( i ) + tr_pieceCountBlocks( i ) )
+        else if( j > -1 && io->pieceSlot[j] < 0 )
         {
-            tr_dbg( "Piece %d is complete", i );
-            tr_bitfieldAdd( tor->bitfield, i );
+            io->pieceSlot[j] = i;
+            io->slotsUsed    = i + 1;
         }
     }
+    if( ret )
+    {
+        free( buf );
+        free( changed );
+        return 1;
+    }
+
+    /* Fill blockHave and tor->bitfield */
+    fastResumeBlocks( io, blockBitfield );
+    free( buf );
     tr_dbg( "Slot used: %d", io->slotsUsed );
 
-    tr_inf( "Fast resuming successful" );
+    if( running )
+    {
+        tr_inf( "Resume file was saved while running" );
+    }
+    fastResumeRecheck( io, changed, running );
+    free( changed );
+
+    tr_inf( "Fast resuming successful (version %d, %d ms)", version,
+            (int) ( tr_date() - date ) );
     
     return 0;
 }
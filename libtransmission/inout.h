@@ -27,7 +27,13 @@ typedef struct tr_io_s tr_io_t;
 
 tr_io_t * tr_ioInit        ( tr_torrent_t * );
 int       tr_ioRead        ( tr_io_t *, int, int, int, char * );
+int       tr_ioTryRead     ( tr_io_t *, int, int, int, char * );
+int       tr_ioLoading     ( tr_io_t *, int );
+void      tr_ioPrefetch    ( tr_io_t *, int );
 int       tr_ioWrite       ( tr_io_t *, int, int, int, char * );
+void      tr_ioPulse       ( tr_io_t * );
+int       tr_ioChecking    ( tr_io_t * );
+int       tr_ioFull        ( tr_io_t * );
 void      tr_ioClose       ( tr_io_t * );
 
 #endif
@@ -43,6 +43,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#ifndef SYS_BEOS
+#  include <poll.h>
+#  include <sys/statvfs.h>
+#endif
 #ifdef BEOS_NETSERVER
 #  define in_port_t uint16_t
 #else
@@ -68,6 +73,19 @@
    }
 #endif
 
+/* Same thing, for data we get a bit at a time */
+#ifdef HAVE_OPENSSL
+typedef SHA_CTX tr_sha1_t;
+#  define tr_sha1Init(c)       SHA1_Init( c )
+#  define tr_sha1Update(c,p,i) SHA1_Update( c, p, i )
+#  define tr_sha1Final(c,h)    SHA1_Final( (unsigned char *) h, c )
+#else
+typedef sha1_state_s tr_sha1_t;
+#  define tr_sha1Init(c)       sha1_init( c )
+#  define tr_sha1Update(c,p,i) sha1_update( c, (sha1_byte_t *) p, i )
+#  define tr_sha1Final(c,h)    sha1_finish( c, (sha1_byte_t *) h )
+#endif
+
 /* Convenient macros to perform uint32_t endian conversions with
    char pointers */
 #define TR_NTOHL(p,a) (a) = ntohl(*((uint32_t*)(p)))
@@ -115,15 +133,46 @@ typedef struct tr_torrent_s tr_torrent_t;
 #include "metainfo.h"
 #include "tracker.h"
 #include "peer.h"
+#include "peerpool.h"
+#include "smartban.h"
+#include "reader.h"
+#include "uring.h"
 #include "net.h"
 #include "inout.h"
 #include "upload.h"
+#include "connlimit.h"
+#include "fdlimit.h"
+#include "cache.h"
+#include "mapping.h"
+#include "disk.h"
+
+/* Sizes and positions that follow from the metainfo and the block size,
+   computed once so the helpers in utils.h don't have to divide or scan
+   the files every time (see tr_geometryInit) */
+typedef struct
+{
+    int        blocksPerPiece;
+    int        pieceShift;      /* log2( blocksPerPiece ), or -1 if not
+                                   a power of 2 */
+    int        blockShift;      /* log2( blockSize ), or -1 */
+    int        lastPieceSize;
+    int        lastPieceBlocks;
+    int        lastBlockSize;
+
+    uint64_t * fileOffset;      /* Where each file starts */
+    int      * pieceFiles;      /* First and last file of each piece */
+}
+tr_geometry_t;
 
 struct tr_torrent_s
 {
     tr_info_t info;
 
     tr_upload_t     * upload;
+    tr_connlimit_t  * connlimit;
+    tr_fd_t         * fdlimit;
+    tr_cache_t      * cache;
+    tr_disk_t       * disk;
 
     int               status;
     char              error[128];
@@ -137,10 +186,26 @@ struct tr_torrent_s
 
     /* Where to download */
     char            * destination;
+
+    /* TR_ALLOC_COMPACT or TR_ALLOC_FULL */
+    int               allocation;
+
+    /* TR_PREALLOC_NONE, TR_PREALLOC_SPARSE or TR_PREALLOC_FULL */
+    int               preallocation;
+
+    /* TR_STORAGE_FILE or TR_STORAGE_MMAP */
+    int               storage;
+
+    /* Batch disk and network I/O with io_uring (see tr_setIoUring) */
+    int               ioUring;
+
+    /* Bulk reads bypass the system cache (see tr_setDirectIO) */
+    int               directIO;
     
     /* How many bytes we ask for per request */
     int               blockSize;
     int               blockCount;
+    tr_geometry_t     geo;
     
     /* Status for each block
        -1 = we have it
@@ -149,6 +214,23 @@ struct tr_torrent_s
     int               blockHaveCount;
     uint8_t         * bitfield;
 
+    /* While TR_STATUS_CHECK, how many slots we hashed */
+    int               checked;
+
+    /* How many connected peers have each piece */
+    int             * pieceAvail;
+
+    /* Only show complete pieces one by one (see tr_torrentSetSuperSeed) */
+    int               superSeed;
+
+    /* Sequential mode (see tr_torrentSetSequential): how many pieces
+       after the cursor come first, how fast the consumer reads them
+       (KB/s), and where the cursor was moved to and when */
+    int               streamWindow;
+    int               streamRate;
+    uint64_t          streamCursor;
+    uint64_t          streamDate;
+
     volatile char     die;
     tr_thread_t       thread;
     tr_lock_t         lock;
@@ -160,6 +242,9 @@ struct tr_torrent_s
     int               bindPort;
     int               peerCount;
     tr_peer_t       * peers[TR_MAX_PEER_COUNT];
+    tr_peerpool_t   * pool;
+    tr_ban_t        * ban;
+    tr_reader_t     * reader;
 
     uint64_t          dates[10];
     uint64_t          downloaded[10];
@@ -170,13 +255,19 @@ struct tr_torrent_s
 
 struct tr_handle_s
 {
-    int            torrentCount;
-    tr_torrent_t * torrents[TR_MAX_TORRENT_COUNT];
+    int              torrentCount;
+    tr_torrent_t   * torrents[TR_MAX_TORRENT_COUNT];
 
-    tr_upload_t  * upload;
-    int            bindPort;
+    tr_upload_t    * upload;
+    tr_connlimit_t * connlimit;
+    tr_fd_t        * fdlimit;
+    tr_cache_t     * cache;
+    tr_disk_t      * disk;
+    int              bindPort;
+    int              ioUring;
+    int              directIO;
 
-    char           id[21];
+    char             id[21];
 };
 
 #endif
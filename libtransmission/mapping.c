@@ -0,0 +1,383 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+#ifndef SYS_BEOS
+#include <setjmp.h>
+#include <sys/mman.h>
+
+/* We map files by windows of that size, aligned on it, and don't keep
+   more than MAP_BUDGET bytes mapped per torrent */
+#define WINDOW_SIZE (32*1024*1024)
+#define MAP_BUDGET  (256*1024*1024)
+#define MAX_WINDOWS ( MAP_BUDGET / WINDOW_SIZE )
+
+typedef struct
+{
+    int        file;
+    uint64_t   start;
+    uint64_t   length;
+    uint8_t  * addr;
+    uint64_t   date;
+}
+tr_window_t;
+
+struct tr_map_s
+{
+    tr_torrent_t * tor;
+    char        ** paths;
+
+    int            windowCount;
+    tr_window_t    windows[MAX_WINDOWS];
+    uint64_t       date;
+};
+
+/* Where to jump if the current thread gets SIGBUS while it reads a
+   mapping, which happens if the file was truncated behind our back */
+static pthread_once_t   sigbusOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t    sigbusKey;
+
+/* What the application had, for the SIGBUS that are not ours */
+static struct sigaction sigbusOld;
+
+static void      sigbusInit    ();
+static void      sigbusHandler ( int, siginfo_t *, void * );
+static uint8_t * mapWindow     ( tr_map_t *, int, uint64_t, uint64_t * );
+static void      unmapWindow   ( tr_map_t *, int );
+static void      unmapFile     ( tr_map_t *, int );
+static int       safeRead      ( uint8_t *, size_t, uint8_t *,
+                                 tr_sha1_t * );
+
+/***********************************************************************
+ * tr_mapInit
+ ***********************************************************************
+ * Reads through this don't copy the data to a buffer of ours and back,
+ * and hashes go straight over the pages the system already has.
+ * Writes still use the files, since a full disk would kill us with
+ * SIGBUS instead of failing. 'paths' has the full path of each file.
+ * A mapping must not be used by two threads at once: the torrent's is
+ * used with the torrent locked, disk threads make their own.
+ **********************************************************************/
+tr_map_t * tr_mapInit( tr_torrent_t * tor, char ** paths )
+{
+    tr_map_t * m;
+
+    pthread_once( &sigbusOnce, sigbusInit );
+
+    m        = calloc( sizeof( tr_map_t ), 1 );
+    m->tor   = tor;
+    m->paths = paths;
+
+    return m;
+}
+
+/***********************************************************************
+ * tr_mapRead
+ ***********************************************************************
+ * Fills the 'count' buffers in 'iov' from 'pos' in the file. Returns
+ * 1 if the mapping failed and the data should be read the usual way.
+ **********************************************************************/
+int tr_mapRead( tr_map_t * m, int file, uint64_t pos, struct iovec * iov,
+                int count )
+{
+    uint8_t  * addr;
+    uint64_t   avail;
+    size_t     done, len;
+    int        i;
+
+    for( i = 0, done = 0; i < count; )
+    {
+        if( !( addr = mapWindow( m, file, pos, &avail ) ) )
+        {
+            return 1;
+        }
+        len = MIN( avail, iov[i].iov_len - done );
+
+        if( safeRead( addr, len, (uint8_t *) iov[i].iov_base + done,
+                      NULL ) )
+        {
+            unmapFile( m, file );
+            return 1;
+        }
+
+        pos  += len;
+        done += len;
+        if( done >= iov[i].iov_len )
+        {
+            i++;
+            done = 0;
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************
+ * tr_mapHash
+ ***********************************************************************
+ * Adds 'size' bytes from 'pos' in the file to 'sha1'. Returns 1 if the
+ * mapping failed, in which case 'sha1' is garbage.
+ **********************************************************************/
+int tr_mapHash( tr_map_t * m, int file, uint64_t pos, uint64_t size,
+                tr_sha1_t * sha1 )
+{
+    uint8_t  * addr;
+    uint64_t   avail, len;
+
+    while( size > 0 )
+    {
+        if( !( addr = mapWindow( m, file, pos, &avail ) ) )
+        {
+            return 1;
+        }
+        len = MIN( avail, size );
+
+        if( safeRead( addr, len, NULL, sha1 ) )
+        {
+            unmapFile( m, file );
+            return 1;
+        }
+
+        pos  += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+void tr_mapClose( tr_map_t * m )
+{
+    while( m->windowCount > 0 )
+    {
+        unmapWindow( m, 0 );
+    }
+    free( m );
+}
+
+static void sigbusInit()
+{
+    struct sigaction sa;
+
+    pthread_key_create( &sigbusKey, NULL );
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_sigaction = sigbusHandler;
+    sa.sa_flags     = SA_SIGINFO;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGBUS, &sa, &sigbusOld );
+}
+
+static void sigbusHandler( int sig, siginfo_t * info, void * context )
+{
+    sigjmp_buf * jmp = pthread_getspecific( sigbusKey );
+
+    if( jmp )
+    {
+        siglongjmp( *jmp, 1 );
+    }
+
+    /* Not ours, do what the application wanted */
+    if( sigbusOld.sa_flags & SA_SIGINFO )
+    {
+        sigbusOld.sa_sigaction( sig, info, context );
+    }
+    else if( sigbusOld.sa_handler != SIG_DFL &&
+             sigbusOld.sa_handler != SIG_IGN )
+    {
+        sigbusOld.sa_handler( sig );
+    }
+    else
+    {
+        /* Give it back and let it happen */
+        sigaction( SIGBUS, &sigbusOld, NULL );
+        raise( sig );
+    }
+}
+
+/***********************************************************************
+ * safeRead
+ ***********************************************************************
+ * Copies mapped memory to 'dst', or adds it to 'sha1'. Returns 1 if we
+ * got SIGBUS meanwhile.
+ **********************************************************************/
+static int safeRead( uint8_t * addr, size_t len, uint8_t * dst,
+                     tr_sha1_t * sha1 )
+{
+    sigjmp_buf jmp;
+
+    if( sigsetjmp( jmp, 1 ) )
+    {
+        pthread_setspecific( sigbusKey, NULL );
+        return 1;
+    }
+    pthread_setspecific( sigbusKey, &jmp );
+    if( dst )
+    {
+        memcpy( dst, addr, len );
+    }
+    else
+    {
+        tr_sha1Update( sha1, addr, len );
+    }
+    pthread_setspecific( sigbusKey, NULL );
+
+    return 0;
+}
+
+/***********************************************************************
+ * mapWindow
+ ***********************************************************************
+ * Returns the address of 'pos' in the file and sets 'avail' to how
+ * many bytes can be read there, mapping a new window if needed. Never
+ * maps beyond the end of the file. Returns NULL if 'pos' is beyond it
+ * or the mapping failed.
+ **********************************************************************/
+static uint8_t * mapWindow( tr_map_t * m, int file, uint64_t pos,
+                            uint64_t * avail )
+{
+    tr_torrent_t * tor = m->tor;
+    tr_window_t  * w;
+    struct stat    sb;
+    uint64_t       start;
+    uint8_t      * addr;
+    int            i, lru, fd;
+
+    start = pos - pos % WINDOW_SIZE;
+    for( i = 0; i < m->windowCount; i++ )
+    {
+        w = &m->windows[i];
+        if( w->file != file || w->start != start )
+        {
+            continue;
+        }
+        if( pos < w->start + w->length )
+        {
+            w->date = ++(m->date);
+            *avail  = w->start + w->length - pos;
+            return w->addr + ( pos - w->start );
+        }
+
+        /* The file has grown since we mapped it */
+        unmapWindow( m, i );
+        break;
+    }
+
+    fd = tr_fdFileOpen( tor->fdlimit, m->paths[file],
+                        tor->blockHaveCount < tor->blockCount ?
+                        TR_FD_WRITE : 0 );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+    if( fstat( fd, &sb ) || pos >= (uint64_t) sb.st_size )
+    {
+        tr_fdFileRelease( tor->fdlimit, fd );
+        return NULL;
+    }
+
+    if( m->windowCount >= MAX_WINDOWS )
+    {
+        for( i = 0, lru = 0; i < m->windowCount; i++ )
+        {
+            if( m->windows[i].date < m->windows[lru].date )
+            {
+                lru = i;
+            }
+        }
+        unmapWindow( m, lru );
+    }
+
+    w         = &m->windows[m->windowCount];
+    w->file   = file;
+    w->start  = start;
+    w->length = MIN( WINDOW_SIZE, (uint64_t) sb.st_size - start );
+    addr      = mmap( NULL, w->length, PROT_READ, MAP_SHARED, fd,
+                      w->start );
+    tr_fdFileRelease( tor->fdlimit, fd );
+    if( addr == MAP_FAILED )
+    {
+        tr_err( "Could not mmap %s (%s)", m->paths[file],
+                strerror( errno ) );
+        return NULL;
+    }
+    w->addr = addr;
+    w->date = ++(m->date);
+    (m->windowCount)++;
+
+    *avail = w->start + w->length - pos;
+    return w->addr + ( pos - w->start );
+}
+
+static void unmapWindow( tr_map_t * m, int i )
+{
+    munmap( m->windows[i].addr, m->windows[i].length );
+    (m->windowCount)--;
+    m->windows[i] = m->windows[m->windowCount];
+}
+
+/***********************************************************************
+ * unmapFile
+ ***********************************************************************
+ * We got SIGBUS reading the file: forget what we knew about its size
+ **********************************************************************/
+static void unmapFile( tr_map_t * m, int file )
+{
+    int i;
+
+    tr_err( "SIGBUS reading %s", m->paths[file] );
+    for( i = 0; i < m->windowCount; )
+    {
+        if( m->windows[i].file == file )
+        {
+            unmapWindow( m, i );
+            continue;
+        }
+        i++;
+    }
+}
+
+#else
+
+/* No mmap() on BeOS, always use the files */
+tr_map_t * tr_mapInit( tr_torrent_t * tor, char ** paths )
+{
+    return NULL;
+}
+
+int tr_mapRead( tr_map_t * m, int file, uint64_t pos, struct iovec * iov,
+                int count )
+{
+    return 1;
+}
+
+int tr_mapHash( tr_map_t * m, int file, uint64_t pos, uint64_t size,
+                tr_sha1_t * sha1 )
+{
+    return 1;
+}
+
+void tr_mapClose( tr_map_t * m )
+{
+}
+
+#endif
@@ -171,6 +171,55 @@ int tr_netAccept( int s, struct in_addr * addr, in_port_t * port )
     return makeSocketNonBlocking( t );
 }
 
+/***********************************************************************
+ * tr_netCheckConnect
+ ***********************************************************************
+ * Tells whether the non-blocking connect() started by tr_netOpen has
+ * completed. Returns 0 if the socket is connected, TR_NET_BLOCK if it
+ * is still in progress, or TR_NET_CLOSE if it failed.
+ **********************************************************************/
+int tr_netCheckConnect( int s )
+{
+    int       err;
+    socklen_t len;
+#ifdef SYS_BEOS
+    fd_set         set;
+    struct timeval tv;
+
+    FD_ZERO( &set );
+    FD_SET( s, &set );
+    tv.tv_sec  = 0;
+    tv.tv_usec = 0;
+    err = select( s + 1, NULL, &set, NULL, &tv );
+#else
+    struct pollfd pfd;
+
+    pfd.fd     = s;
+    pfd.events = POLLOUT;
+    err = poll( &pfd, 1, 0 );
+#endif
+
+    if( !err )
+    {
+        /* Not writable yet */
+        return TR_NET_BLOCK;
+    }
+    if( err < 0 )
+    {
+        return ( errno == EINTR ) ? TR_NET_BLOCK : TR_NET_CLOSE;
+    }
+
+    len = sizeof( err );
+    if( getsockopt( s, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 || err )
+    {
+        tr_dbg( "Could not connect socket (%s)",
+                strerror( err ? err : errno ) );
+        return TR_NET_CLOSE;
+    }
+
+    return 0;
+}
+
 int tr_netSend( int s, char * buf, int size )
 {
     int ret;
@@ -178,7 +227,7 @@ int tr_netSend( int s, char * buf, int size )
     ret = send( s, buf, size, 0 );
     if( ret < 0 )
     {
-        if( errno == ENOTCONN || errno == EAGAIN || errno == EWOULDBLOCK )
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
         {
             ret = TR_NET_BLOCK;
         }
@@ -215,6 +264,29 @@ int tr_netRecv( int s, char * buf, int size )
     return ret;
 }
 
+/***********************************************************************
+ * tr_netResult
+ ***********************************************************************
+ * Once a recv or send queued on an io_uring was submitted, returns
+ * what tr_netRecv or tr_netSend would have
+ **********************************************************************/
+int tr_netResult( tr_uring_t * u, int op, int recv )
+{
+    int ret;
+
+    ret = tr_uringResult( u, op );
+    if( ret == -EAGAIN || ret == -EWOULDBLOCK )
+    {
+        ret = TR_NET_BLOCK;
+    }
+    else if( ret < 0 || ( recv && !ret ) )
+    {
+        ret = TR_NET_CLOSE;
+    }
+
+    return ret;
+}
+
 void tr_netClose( int s )
 {
 #ifdef BEOS_NETSERVER
@@ -28,5 +28,7 @@ void tr_netClose   ( int s );
 
 #define TR_NET_BLOCK 0x80000000
 #define TR_NET_CLOSE 0x40000000
+int  tr_netCheckConnect( int s );
 int  tr_netSend    ( int s, char * buf, int size );
 int  tr_netRecv    ( int s, char * buf, int size );
+int  tr_netResult  ( tr_uring_t *, int op, int recv );
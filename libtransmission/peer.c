@@ -28,7 +28,18 @@
 static int checkPeer       ( tr_torrent_t *, int );
 static int parseMessage    ( tr_torrent_t *, tr_peer_t *, int );
 static int isInteresting   ( tr_torrent_t *, tr_peer_t * );
+static int askedFor        ( tr_torrent_t *, tr_peer_t *, int );
+static void releaseRequests( tr_torrent_t *, tr_peer_t * );
+static float inRate        ( tr_peer_t * );
+static int isFast          ( tr_torrent_t *, tr_peer_t * );
+static int chooseInOrder   ( tr_torrent_t *, tr_peer_t *, int, int, int );
 static int chooseBlock     ( tr_torrent_t *, tr_peer_t * );
+static int connectPeer     ( tr_torrent_t * );
+static void inBuffer       ( tr_peer_t * );
+static int sendData        ( tr_torrent_t *, tr_peer_t * );
+static void sentData       ( tr_torrent_t *, tr_peer_t *, int );
+static void recvBatch      ( tr_torrent_t *, tr_uring_t * );
+static void sendBatch      ( tr_torrent_t *, tr_uring_t * );
 
 /***********************************************************************
  * tr_peerAddOld
@@ -72,10 +83,11 @@ void tr_peerAddCompact( tr_torrent_t * tor, struct in_addr addr,
         return;
     }
 
-    peer->socket = s;
-    peer->addr   = addr;
-    peer->port   = port;
-    peer->status = PEER_STATUS_CONNECTING;
+    peer->socket   = s;
+    peer->addr     = addr;
+    peer->port     = port;
+    peer->incoming = 1;
+    peer->status   = PEER_STATUS_CONNECTING;
 }
 
 /***********************************************************************
@@ -89,20 +101,26 @@ void tr_peerRem( tr_torrent_t * tor, int i )
     tr_peer_t * peer = tor->peers[i];
     int j;
 
-    for( j = 0; j < peer->inRequestCount; j++ )
-    {
-        tr_request_t * r;
-        r = &peer->inRequests[j];
-        tor->blockHave[tr_block(r->index,r->begin)]--;
-    }
+    releaseRequests( tor, peer );
     if( !peer->amChoking )
     {
         tr_uploadChoked( tor->upload );
     }
     if( peer->bitfield )
     {
+        for( j = 0; j < tor->info.pieceCount; j++ )
+        {
+            if( tr_bitfieldHas( peer->bitfield, j ) )
+            {
+                (tor->pieceAvail[j])--;
+            }
+        }
         free( peer->bitfield );
     }
+    if( peer->offered )
+    {
+        free( peer->offered );
+    }
     if( peer->buf )
     {
         free( peer->buf );
@@ -111,10 +129,28 @@ void tr_peerRem( tr_torrent_t * tor, int i )
     {
         free( peer->outBuf );
     }
-    if( peer->status > PEER_STATUS_IDLE )
+    if( peer->outRequests )
+    {
+        free( peer->outRequests );
+    }
+    if( peer->status & PEER_STATUS_OPENING )
+    {
+        tr_connlimitRelease( tor->connlimit );
+    }
+    if( !peer->incoming )
     {
-        tr_netClose( peer->socket );
+        float rate = 0.0;
+        if( peer->status & PEER_STATUS_CONNECTED &&
+            tr_date() > peer->connectDate )
+        {
+            rate = 1000.0 / 1024.0 *
+                (float) ( peer->inTotal + peer->outTotal ) /
+                (float) ( tr_date() - peer->connectDate );
+        }
+        tr_peerpoolDone( tor->pool, peer->addr, peer->port,
+                         peer->status & PEER_STATUS_CONNECTED, rate );
     }
+    tr_netClose( peer->socket );
     free( peer );
     tor->peerCount--;
     memmove( &tor->peers[i], &tor->peers[i+1],
@@ -129,7 +165,8 @@ void tr_peerRem( tr_torrent_t * tor, int i )
 void tr_peerPulse( tr_torrent_t * tor )
 {
     int i, ret;
-    tr_peer_t * peer;
+    tr_peer_t  * peer;
+    tr_uring_t * u;
 
     tor->dates[9] = tr_date();
     if( tor->dates[9] > tor->dates[8] + 1000 )
@@ -160,12 +197,27 @@ void tr_peerPulse( tr_torrent_t * tor )
         struct in_addr addr;
         in_port_t      port;
         s = tr_netAccept( tor->bindSocket, &addr, &port );
-        if( s > -1 )
+        if( s > -1 && tr_banIsBanned( tor->ban, addr ) )
+        {
+            tr_netClose( s );
+        }
+        else if( s > -1 )
         {
             tr_peerAddCompact( tor, addr, port, s );
         }
     }
     
+    /* Connect to new peers while we have room for them */
+    while( tor->peerCount < TR_MAX_PEER_COUNT &&
+           tr_connlimitReserve( tor->connlimit ) )
+    {
+        if( connectPeer( tor ) )
+        {
+            tr_connlimitCancel( tor->connlimit );
+            break;
+        }
+    }
+
     /* Shuffle peers */
     if( tor->peerCount > 1 )
     {
@@ -175,19 +227,33 @@ void tr_peerPulse( tr_torrent_t * tor )
         tor->peers[tor->peerCount - 1] = peer;
     }
 
+    /* With io_uring, we receive from all peers at once now, and send
+       to all of them at once after the loop */
+    u = tor->ioUring ? tr_uringGet() : NULL;
+    if( u )
+    {
+        recvBatch( tor, u );
+    }
+
     /* Handle peers */
     for( i = 0; i < tor->peerCount; )
     {
         peer = tor->peers[i];
 
-        /* Connect */
-        if( peer->status & PEER_STATUS_IDLE )
+        /* Wait until the connection is established */
+        if( peer->status & PEER_STATUS_OPENING )
         {
-            peer->socket = tr_netOpen( peer->addr, peer->port );
-            if( peer->socket < 0 )
+            ret = tr_netCheckConnect( peer->socket );
+            if( ret & TR_NET_CLOSE )
             {
                 goto dropPeer;
             }
+            else if( ret & TR_NET_BLOCK )
+            {
+                i++;
+                continue;
+            }
+            tr_connlimitRelease( tor->connlimit );
             peer->status = PEER_STATUS_CONNECTING;
         }
 
@@ -199,6 +265,7 @@ void tr_peerPulse( tr_torrent_t * tor )
 
             sprintf( buf, "%cBitTorrent protocol", 19 );
             memset( &buf[20], 0, 8 );
+            buf[25] = 0x10; /* Extension protocol */
             memcpy( &buf[28], inf->hash, 20 );
             memcpy( &buf[48], tor->id, 20 );
 
@@ -218,18 +285,18 @@ void tr_peerPulse( tr_torrent_t * tor )
         /* Try to read */
         if( peer->status >= PEER_STATUS_HANDSHAKE )
         {
-            if( peer->size < 1 )
+            if( peer->inResult )
             {
-                peer->size = 1024;
-                peer->buf  = malloc( peer->size );
+                /* recvBatch did */
+                ret            = peer->inResult;
+                peer->inResult = 0;
             }
-            else if( peer->pos >= peer->size )
+            else
             {
-                peer->size *= 2;
-                peer->buf   = realloc( peer->buf, peer->size );
+                inBuffer( peer );
+                ret = tr_netRecv( peer->socket, &peer->buf[peer->pos],
+                                  peer->size - peer->pos );
             }
-            ret = tr_netRecv( peer->socket, &peer->buf[peer->pos],
-                              peer->size - peer->pos );
             if( ret & TR_NET_CLOSE )
             {
                 goto dropPeer;
@@ -255,36 +322,9 @@ void tr_peerPulse( tr_torrent_t * tor )
         }
 
         /* Try to write */
-        while( peer->outPos > 0 )
+        if( !u && sendData( tor, peer ) )
         {
-            int willSend;
-            
-            if( peer->outPos > 100 &&
-                !tr_uploadCanUpload( tor->upload ) )
-            {
-                break;
-            }
-
-            willSend = MIN( peer->outPos, 1024 );
-
-            ret = tr_netSend( peer->socket, peer->outBuf, willSend );
-            if( ret & TR_NET_CLOSE )
-            {
-                goto dropPeer;
-            }
-            else if( ret & TR_NET_BLOCK )
-            {
-                break;
-            }
-            tr_uploadUploaded( tor->upload, willSend );
-
-            peer->outPos -= willSend;
-            memmove( &peer->outBuf[0], &peer->outBuf[willSend],
-                     peer->outPos );
-
-            tor->uploaded[9] += willSend;
-            peer->outTotal   += willSend;
-            peer->outDate     = tr_date();
+            goto dropPeer;
         }
 
         /* Connected peers: update interest if required and ask for
@@ -312,10 +352,12 @@ void tr_peerPulse( tr_torrent_t * tor )
             
             if( peer->amInterested && !peer->peerChoking )
             {
-                while( peer->inRequestCount < MAX_REQUEST_COUNT / 2 )
+                int block;
+                while( peer->inRequestCount < MAX_REQUEST_COUNT / 2 &&
+                       !tr_ioFull( tor->io ) &&
+                       ( block = chooseBlock( tor, peer ) ) > -1 )
                 {
-                    tr_peerSendRequest( tor, peer,
-                                        chooseBlock( tor, peer ) );
+                    tr_peerSendRequest( tor, peer, block );
                 }
             }
         }
@@ -326,6 +368,11 @@ void tr_peerPulse( tr_torrent_t * tor )
 dropPeer:
         tr_peerRem( tor, i );
     }
+
+    if( u )
+    {
+        sendBatch( tor, u );
+    }
 }
 
 /***********************************************************************
@@ -376,6 +423,18 @@ static int checkPeer( tr_torrent_t * tor, int i )
 {
     tr_peer_t * peer = tor->peers[i];
 
+    if( tr_banIsBanned( tor->ban, peer->addr ) )
+    {
+        return 1;
+    }
+
+    if( ( peer->status & PEER_STATUS_OPENING ) &&
+        tr_date() > peer->date + 10000 )
+    {
+        /* Give up, so someone else may use the half-open slot */
+        return 1;
+    }
+
     if( ( peer->status & PEER_STATUS_HANDSHAKE ) &&
         tr_date() > peer->date + 8000 )
     {
@@ -417,6 +476,12 @@ static int checkPeer( tr_torrent_t * tor, int i )
     /* Choke or unchoke some people */
     /* TODO: prefer people who upload to us */
 
+    if( peer->offered && !tr_peerSuperSeeding( tor ) )
+    {
+        /* Super-seeding was turned off */
+        tr_peerStopOffering( tor, peer );
+    }
+
     if( peer->status & PEER_STATUS_CONNECTED )
     {
         /* Send keep-alive every 2 minutes */
@@ -443,16 +508,61 @@ static int checkPeer( tr_torrent_t * tor, int i )
     return 0;
 }
 
+/***********************************************************************
+ * connectPeer
+ ***********************************************************************
+ * Starts connecting to the best peer from the pool. Returns 1 if there
+ * was no peer to try, 0 otherwise.
+ **********************************************************************/
+static int connectPeer( tr_torrent_t * tor )
+{
+    struct in_addr addr;
+    in_port_t      port;
+    tr_peer_t    * peer;
+    int            s;
+
+    for( ;; )
+    {
+        if( tr_peerpoolNext( tor->pool, &addr, &port ) )
+        {
+            return 1;
+        }
+        if( !tr_banIsBanned( tor->ban, addr ) )
+        {
+            break;
+        }
+        /* It will eventually be forgotten */
+        tr_peerpoolDone( tor->pool, addr, port, 0, 0.0 );
+    }
+
+    s = tr_netOpen( addr, port );
+    if( s < 0 )
+    {
+        tr_connlimitRelease( tor->connlimit );
+        tr_peerpoolDone( tor->pool, addr, port, 0, 0.0 );
+        return 0;
+    }
+
+    peer         = tr_peerInit( tor );
+    peer->socket = s;
+    peer->addr   = addr;
+    peer->port   = port;
+    peer->status = PEER_STATUS_OPENING;
+
+    return 0;
+}
+
 static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                          int newBytes )
 {
     tr_info_t * inf = &tor->info;
 
-    int    i;
+    int    i, j;
     int    len;
     char   id;
     char * p   = peer->buf;
     char * end = &p[peer->pos];
+    int    maxLength = tr_uploadRequestSize( tor->upload );
     
     for( ;; )
     {
@@ -494,7 +604,9 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                 return 1;
             }
 
-            peer->status  = PEER_STATUS_CONNECTED;
+            peer->status      = PEER_STATUS_CONNECTED;
+            peer->connectDate = tr_date();
+            peer->extended    = ( p[25] & 0x10 ) ? 1 : 0;
             memcpy( peer->id, &p[48], 20 );
             p            += 68;
             peer->pos    -= 68;
@@ -516,7 +628,21 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
             tr_dbg( "%08x:%04x GET  handshake, ok",
                     peer->addr.s_addr, peer->port );
 
-            tr_peerSendBitfield( tor, peer );
+            if( peer->extended )
+            {
+                tr_peerSendExtended( tor, peer );
+            }
+
+            if( tr_peerSuperSeeding( tor ) )
+            {
+                /* Don't show everything we have */
+                peer->offered = calloc( ( inf->pieceCount + 7 ) / 8, 1 );
+                tr_peerSendOffer( tor, peer );
+            }
+            else
+            {
+                tr_peerSendBitfield( tor, peer );
+            }
             continue;
         }
         
@@ -524,7 +650,10 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
         TR_NTOHL( p, len );
         p += 4;
 
-        if( len > 9 + tor->blockSize )
+        /* Pieces and extension messages may be as large as the
+           requests we make, bitfields depend on the torrent */
+        if( len > 9 + maxLength &&
+            len != 1 + ( inf->pieceCount + 7 ) / 8 )
         {
             /* This shouldn't happen. Forget about that peer */
             tr_dbg( "%08x:%04x message too large",
@@ -573,6 +702,9 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                 tr_dbg( "%08x:%04x GET  choke",
                         peer->addr.s_addr, peer->port );
                 peer->peerChoking    = 1;
+
+                /* Our requests are lost, let others get these blocks */
+                releaseRequests( tor, peer );
                 peer->inRequestCount = 0;
                 break;
             case 1: /* unchoke */
@@ -610,14 +742,45 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                     return 1;
                 }
                 TR_NTOHL( p, piece );
+                if( piece >= (uint32_t) inf->pieceCount )
+                {
+                    return 1;
+                }
                 if( !peer->bitfield )
                 {
                     peer->bitfield = calloc( ( inf->pieceCount + 7 ) / 8, 1 );
                 }
-                tr_bitfieldAdd( peer->bitfield, piece );
+                if( !tr_bitfieldHas( peer->bitfield, piece ) )
+                {
+                    tr_bitfieldAdd( peer->bitfield, piece );
+                    (tor->pieceAvail[piece])++;
+                }
 
                 tr_dbg( "%08x:%04x GET  have %d",
                         peer->addr.s_addr, peer->port, piece );
+
+                /* Super-seeding: whoever we gave this piece to shared
+                   it, he deserves a new one */
+                j = 0;
+                for( i = 0; i < tor->peerCount; i++ )
+                {
+                    tr_peer_t * other = tor->peers[i];
+                    if( !other->offered )
+                    {
+                        continue;
+                    }
+                    j++;
+                    if( other != peer && other->offeredPiece == (int) piece )
+                    {
+                        tr_peerSendOffer( tor, other );
+                    }
+                }
+                if( peer->offered && peer->offeredPiece == (int) piece &&
+                    j < 2 )
+                {
+                    /* Nobody to share it with, don't starve him */
+                    tr_peerSendOffer( tor, peer );
+                }
                 break;
             }
             case 5: /* bitfield */
@@ -652,25 +815,48 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
 
                 if( !peer->bitfield )
                 {
-                    peer->bitfield = malloc( bitfieldSize );
+                    peer->bitfield = calloc( bitfieldSize, 1 );
+                }
+                for( i = 0; i < inf->pieceCount; i++ )
+                {
+                    if( tr_bitfieldHas( peer->bitfield, i ) )
+                    {
+                        (tor->pieceAvail[i])--;
+                    }
+                    if( tr_bitfieldHas( (uint8_t *) p, i ) )
+                    {
+                        (tor->pieceAvail[i])++;
+                    }
                 }
                 memcpy( peer->bitfield, p, bitfieldSize );
 
                 tr_dbg( "%08x:%04x GET  bitfield, ok",
                         peer->addr.s_addr, peer->port );
+
+                if( peer->offered && peer->offeredPiece > -1 &&
+                    tr_bitfieldHas( peer->bitfield, peer->offeredPiece ) )
+                {
+                    /* He got it elsewhere already */
+                    tr_peerSendOffer( tor, peer );
+                }
                 break;
             }
             case 6: /* request */
             {
                 int index, begin, length;
 
+                if( len != 13 )
+                {
+                    return 1;
+                }
+
                 if( peer->amChoking )
                 {
                     /* Didn't he get it? */
                     tr_peerSendChoke( peer, 1 );
                     break;
                 }
-                
+
                 TR_NTOHL( p,     index );
                 TR_NTOHL( &p[4], begin );
                 TR_NTOHL( &p[8], length );
@@ -679,22 +865,32 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                         peer->addr.s_addr, peer->port,
                         index, begin, length );
 
-                /* TODO sanity checks (do we have the piece, etc) */
-
-                if( peer->outRequestCount < MAX_REQUEST_COUNT )
+                if( index < 0 || index >= inf->pieceCount ||
+                    begin < 0 || length < 1 ||
+                    length > maxLength ||
+                    begin + length > tr_pieceSize( index ) )
                 {
-                    tr_request_t * r;
-                    
-                    r         = &peer->outRequests[peer->outRequestCount];
-                    r->index  = index;
-                    r->begin  = begin;
-                    r->length = length;
+                    tr_dbg( "%08x:%04x request out of bounds",
+                            peer->addr.s_addr, peer->port );
+                    return 1;
+                }
 
-                    (peer->outRequestCount)++;
+                if( !tr_bitfieldHas( tor->bitfield, index ) ||
+                    ( peer->offered &&
+                      !tr_bitfieldHas( peer->offered, index ) ) )
+                {
+                    /* We never told him we have it */
+                    tr_dbg( "%08x:%04x request for a missing piece",
+                            peer->addr.s_addr, peer->port );
+                    break;
                 }
-                else
+
+                if( tr_peerQueueRequest( tor, peer, index, begin,
+                                         length ) )
                 {
-                    tr_err( "Arggg too many requests" );
+                    tr_dbg( "%08x:%04x request queue full (%d)",
+                            peer->addr.s_addr, peer->port,
+                            peer->outRequestCount );
                 }
                 break;
             }
@@ -715,12 +911,21 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                         peer->addr.s_addr, peer->port,
                         index, begin, len - 9 );
                 
-                r = &peer->inRequests[0];
-                if( index != r->index || begin != r->begin )
+                /* Usually the first one, unless the peer skipped some
+                   requests or we asked for the same block twice */
+                for( j = 0; j < peer->inRequestCount; j++ )
                 {
-                    tr_dbg( "wrong piece (expecting %d/%d)",
-                            r->index, r->begin );
-                    return 1;
+                    r = &peer->inRequests[j];
+                    if( index == r->index && begin == r->begin )
+                    {
+                        break;
+                    }
+                }
+                if( j >= peer->inRequestCount )
+                {
+                    /* We didn't ask for it (anymore?), ignore it */
+                    tr_dbg( "unexpected piece %d/%d", index, begin );
+                    break;
                 }
 
                 if( len - 9 != r->length )
@@ -729,19 +934,29 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                     return 1;
                 }
 
-                block = tr_block( r->index, r->begin );
-                if( tor->blockHave[block] < 0 )
+                /* Save the blocks we don't have yet. Large requests
+                   span several of them */
+                for( block = tr_block( index, begin ), i = 0;
+                     i < r->length; block++ )
                 {
-                    /* We got this block already, too bad */
-                    (peer->inRequestCount)--;
-                    memmove( &peer->inRequests[0], &peer->inRequests[1],
-                             peer->inRequestCount * sizeof( tr_request_t ) );
-                    break;
+                    int size = tr_blockSize( block );
+                    if( tor->blockHave[block] >= 0 )
+                    {
+                        tor->blockHave[block]  = -1;
+                        tor->blockHaveCount   +=  1;
+                        tr_banBlockFrom( tor->ban, block, peer->addr );
+                        tr_ioWrite( tor->io, index, begin + i, size,
+                                    &p[8+i] );
+                    }
+                    /* Otherwise, we got this block already, too bad */
+                    i += size;
                 }
 
-                tor->blockHave[block]  = -1;
-                tor->blockHaveCount   +=  1;
-                tr_ioWrite( tor->io, index, begin, len - 9, &p[8] );
+                if( tr_banIsBanned( tor->ban, peer->addr ) )
+                {
+                    /* He just got caught */
+                    return 1;
+                }
 
 #if 0
                 for( i = 0; i < tor->peerCount; i++ )
@@ -759,14 +974,10 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
                 }
 #endif
 
-                if( tr_bitfieldHas( tor->bitfield, index ) )
-                {
-                    tr_peerSendHave( tor, index );
-                }
-
                 (peer->inRequestCount)--;
-                memmove( &peer->inRequests[0], &peer->inRequests[1],
-                         peer->inRequestCount * sizeof( tr_request_t ) );
+                memmove( &peer->inRequests[j], &peer->inRequests[j+1],
+                         ( peer->inRequestCount - j ) *
+                             sizeof( tr_request_t ) );
                 break;
             }
             case 8: /* cancel */
@@ -798,6 +1009,37 @@ static int parseMessage( tr_torrent_t * tor, tr_peer_t * peer,
 
                 break;
             }
+            case 20: /* extended */
+            {
+                benc_val_t   val, * item;
+
+                if( len < 2 )
+                {
+                    return 1;
+                }
+                if( p[0] )
+                {
+                    /* We didn't announce any extension message */
+                    break;
+                }
+                if( tr_bencLoad( &p[1], len - 2, &val, NULL ) )
+                {
+                    tr_dbg( "%08x:%04x GET  extended handshake, invalid",
+                            peer->addr.s_addr, peer->port );
+                    return 1;
+                }
+                tr_dbg( "%08x:%04x GET  extended handshake",
+                        peer->addr.s_addr, peer->port );
+
+                item = tr_bencDictFind( &val, "reqsize" );
+                if( item && item->type == TYPE_INT &&
+                    item->val.i > tor->blockSize )
+                {
+                    peer->maxRequest = MIN( item->val.i, 1 << 20 );
+                }
+                tr_bencFree( &val );
+                break;
+            }
             default: /* Should not happen */
                 break;
         }
@@ -840,29 +1082,233 @@ static int isInteresting( tr_torrent_t * tor, tr_peer_t * peer )
     return 0;
 }
 
+/***********************************************************************
+ * askedFor
+ ***********************************************************************
+ * Returns 1 if we already requested 'block' from this peer
+ **********************************************************************/
+static int askedFor( tr_torrent_t * tor, tr_peer_t * peer, int block )
+{
+    tr_request_t * r;
+    int            i;
+
+    for( i = 0; i < peer->inRequestCount; i++ )
+    {
+        r = &peer->inRequests[i];
+        if( block >= tr_block( r->index, r->begin ) &&
+            block <= tr_block( r->index, r->begin + r->length - 1 ) )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************
+ * releaseRequests
+ ***********************************************************************
+ * Our requests to this peer won't be answered: we are no longer
+ * downloading these blocks from him
+ **********************************************************************/
+static void releaseRequests( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    tr_request_t * r;
+    int            i, block;
+
+    for( i = 0; i < peer->inRequestCount; i++ )
+    {
+        r = &peer->inRequests[i];
+        for( block = tr_block( r->index, r->begin );
+             block <= tr_block( r->index, r->begin + r->length - 1 );
+             block++ )
+        {
+            if( tor->blockHave[block] > 0 )
+            {
+                /* The counter may have been reset by a hash failure,
+                   or we may have got the block from someone else */
+                (tor->blockHave[block])--;
+            }
+        }
+    }
+}
+
+/***********************************************************************
+ * inRate
+ ***********************************************************************
+ * Average speed at which the peer has been sending us data since we
+ * connected, in bytes per millisecond
+ **********************************************************************/
+static float inRate( tr_peer_t * peer )
+{
+    uint64_t now = tr_date();
+
+    if( now <= peer->connectDate )
+    {
+        return 0.0;
+    }
+    return (float) peer->inTotal / ( now - peer->connectDate );
+}
+
+/***********************************************************************
+ * isFast
+ ***********************************************************************
+ * Returns 1 if this peer sends us data at least as fast as the average
+ * of the peers we are downloading from
+ **********************************************************************/
+static int isFast( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    float total = 0.0;
+    int   i, count = 0;
+
+    if( !peer->inTotal )
+    {
+        return 0;
+    }
+
+    for( i = 0; i < tor->peerCount; i++ )
+    {
+        if( tor->peers[i]->inTotal )
+        {
+            total += inRate( tor->peers[i] );
+            count++;
+        }
+    }
+
+    return inRate( peer ) * count >= total;
+}
+
+/***********************************************************************
+ * chooseInOrder
+ ***********************************************************************
+ * Looks at pieces 'first' to 'last' - 1, in order, and returns the
+ * first block nobody is sending us yet. If they are all on their way
+ * but a piece is late, fast peers are also asked for its blocks so
+ * whoever answers first wins. With 'late' set, all pieces are late;
+ * otherwise, they are given deadlines from the sequential mode
+ * settings. Returns -1 if there is nothing to ask this peer.
+ **********************************************************************/
+static int chooseInOrder( tr_torrent_t * tor, tr_peer_t * peer,
+                          int first, int last, int late )
+{
+    tr_info_t * inf = &tor->info;
+    int         i, piece, startBlock, endBlock;
+    int         urgent = -1;
+    uint64_t    now = tr_date();
+
+    last = MIN( last, inf->pieceCount );
+
+    for( piece = first; piece < last; piece++ )
+    {
+        if( tr_bitfieldHas( tor->bitfield, piece ) ||
+            !tr_bitfieldHas( peer->bitfield, piece ) )
+        {
+            continue;
+        }
+
+        startBlock = tr_pieceStartBlock( piece );
+        endBlock   = startBlock + tr_pieceCountBlocks( piece );
+        for( i = startBlock; i < endBlock; i++ )
+        {
+            if( !tor->blockHave[i] )
+            {
+                return i;
+            }
+        }
+
+        /* Every block is requested already: is it late? The consumer
+           reaches the piece at its deadline. Without a rate, only the
+           piece under the cursor has one (now). */
+        if( urgent < 0 && late )
+        {
+            urgent = piece;
+        }
+        else if( urgent < 0 )
+        {
+            uint64_t offset, deadline;
+
+            offset   = (uint64_t) piece * inf->pieceSize;
+            deadline = tor->streamDate;
+            if( piece > first && tor->streamRate < 1 )
+            {
+                continue;
+            }
+            if( offset > tor->streamCursor )
+            {
+                deadline += ( offset - tor->streamCursor ) * 1000 /
+                                ( tor->streamRate * 1024 );
+            }
+            if( deadline < now + STREAM_URGENT )
+            {
+                urgent = piece;
+            }
+        }
+    }
+
+    if( urgent < 0 || !isFast( tor, peer ) )
+    {
+        return -1;
+    }
+
+    startBlock = tr_pieceStartBlock( urgent );
+    endBlock   = startBlock + tr_pieceCountBlocks( urgent );
+    for( i = startBlock; i < endBlock; i++ )
+    {
+        if( tor->blockHave[i] > 0 && !askedFor( tor, peer, i ) )
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 /***********************************************************************
  * chooseBlock
  ***********************************************************************
  * At this point, we know the peer has at least one block we have an
  * interest in. If he has more than one, we choose which one we are
  * going to ask first.
- * Our main goal is to complete pieces, so we look the pieces which are
- * missing less blocks.
+ * Pieces needed by pending reads come first, then in sequential mode
+ * the window after the cursor.
+ * Otherwise, our main goal is to complete pieces, so we look the pieces
+ * which are missing less blocks, and among those the rarest ones.
  **********************************************************************/
 static int chooseBlock( tr_torrent_t * tor, tr_peer_t * peer )
 {
     tr_info_t * inf = &tor->info;
 
-    int i, j;
+    int i, j, first, last;
     int startBlock, endBlock, countBlocks;
-    int missingBlocks, minMissing;
+    int missingBlocks, minMissing, minAvail;
     int poolSize, * pool;
     int block, minDownloading;
 
+    /* Somebody is waiting for these in tr_torrentRead */
+    for( i = 0; !tr_readerRange( tor->reader, i, &first, &last ); i++ )
+    {
+        block = chooseInOrder( tor, peer, first, last + 1, 1 );
+        if( block > -1 )
+        {
+            return block;
+        }
+    }
+
+    if( tor->streamWindow > 0 )
+    {
+        i     = tor->streamCursor / inf->pieceSize;
+        block = chooseInOrder( tor, peer, i, i + tor->streamWindow, 0 );
+        if( block > -1 )
+        {
+            return block;
+        }
+    }
+
     /* Choose a piece */
     pool       = malloc( inf->pieceCount * sizeof( int ) );
     poolSize   = 0;
     minMissing = tor->blockCount + 1;
+    minAvail   = INT_MAX;
     for( i = 0; i < inf->pieceCount; i++ )
     {
         if( !tr_bitfieldHas( peer->bitfield, i ) )
@@ -896,12 +1342,14 @@ static int chooseBlock( tr_torrent_t * tor, tr_peer_t * peer )
         }
 
         /* We are interested in this piece, remember it */
-        if( missingBlocks < minMissing )
+        if( missingBlocks < minMissing ||
+            ( missingBlocks == minMissing && tor->pieceAvail[i] < minAvail ) )
         {
             minMissing = missingBlocks;
+            minAvail   = tor->pieceAvail[i];
             poolSize   = 0;
         }
-        if( missingBlocks <= minMissing )
+        if( missingBlocks == minMissing && tor->pieceAvail[i] == minAvail )
         {
             pool[poolSize++] = i;
         }
@@ -911,8 +1359,8 @@ static int chooseBlock( tr_torrent_t * tor, tr_peer_t * peer )
     {
         int piece;
 
-        /* All pieces in 'pool' have 'minMissing' missing blocks. Pick
-           a random one. TODO: we should choose the rarest one */
+        /* All pieces in 'pool' have 'minMissing' missing blocks and are
+           the rarest ones. Pick a random one */
         piece = pool[ tr_rand( poolSize ) ];
         free( pool );
 
@@ -933,22 +1381,204 @@ static int chooseBlock( tr_torrent_t * tor, tr_peer_t * peer )
 
     free( pool );
 
-    /* "End game" mode */
+    /* "End game" mode: ask for blocks we are already downloading from
+       others, but never twice from the same peer */
     block          = -1;
     minDownloading = TR_MAX_PEER_COUNT + 1;
     for( i = 0; i < tor->blockCount; i++ )
     {
-        if( tor->blockHave[i] > 0 && tor->blockHave[i] < minDownloading )
+        if( tor->blockHave[i] < 1 || tor->blockHave[i] >= minDownloading ||
+            !tr_bitfieldHas( peer->bitfield, tr_blockPiece( i ) ) )
+        {
+            continue;
+        }
+        if( askedFor( tor, peer, i ) )
+        {
+            continue;
+        }
+        block          = i;
+        minDownloading = tor->blockHave[i];
+    }
+
+    /* -1 if there is nothing left to ask this peer */
+    return block;
+}
+
+/***********************************************************************
+ * inBuffer
+ ***********************************************************************
+ * Makes sure we have room to receive more from the peer
+ **********************************************************************/
+static void inBuffer( tr_peer_t * peer )
+{
+    if( peer->size < 1 )
+    {
+        peer->size = 1024;
+        peer->buf  = malloc( peer->size );
+    }
+    else if( peer->pos >= peer->size )
+    {
+        peer->size *= 2;
+        peer->buf   = realloc( peer->buf, peer->size );
+    }
+}
+
+/***********************************************************************
+ * sendData
+ ***********************************************************************
+ * Sends what we have for the peer, as long as the socket takes it and
+ * the upload limit lets us. Returns 1 if the peer must be dropped.
+ **********************************************************************/
+static int sendData( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    int ret, willSend;
+
+    while( peer->outPos > 0 )
+    {
+        if( peer->outPos > 100 &&
+            !tr_uploadCanUpload( tor->upload ) )
+        {
+            break;
+        }
+
+        willSend = MIN( peer->outPos, 1024 );
+
+        ret = tr_netSend( peer->socket, peer->outBuf, willSend );
+        if( ret & TR_NET_CLOSE )
+        {
+            return 1;
+        }
+        else if( ret & TR_NET_BLOCK )
+        {
+            break;
+        }
+        sentData( tor, peer, willSend );
+    }
+
+    return 0;
+}
+
+static void sentData( tr_torrent_t * tor, tr_peer_t * peer, int size )
+{
+    tr_uploadUploaded( tor->upload, size );
+
+    peer->outPos -= size;
+    memmove( &peer->outBuf[0], &peer->outBuf[size], peer->outPos );
+
+    tor->uploaded[9] += size;
+    peer->outTotal   += size;
+    peer->outDate     = tr_date();
+}
+
+/***********************************************************************
+ * recvBatch
+ ***********************************************************************
+ * Receives from every peer past the connection stage with a single
+ * system call. What we got for each peer is kept in its inResult, for
+ * tr_peerPulse to use instead of calling tr_netRecv.
+ **********************************************************************/
+static void recvBatch( tr_torrent_t * tor, tr_uring_t * u )
+{
+    tr_peer_t * peer;
+    int         i, queued = 0;
+    int         ops[TR_MAX_PEER_COUNT];
+
+    for( i = 0; i < tor->peerCount; i++ )
+    {
+        peer   = tor->peers[i];
+        ops[i] = -1;
+        if( peer->status < PEER_STATUS_HANDSHAKE )
         {
-            block          = i;
-            minDownloading = tor->blockHave[i];
+            continue;
         }
+        inBuffer( peer );
+        ops[i] = tr_uringRecv( u, peer->socket, &peer->buf[peer->pos],
+                               peer->size - peer->pos );
+        queued = queued || ops[i] > -1;
+    }
+    if( !queued )
+    {
+        return;
     }
 
-    if( block < 0 )
+    tr_uringSubmit( u );
+    for( i = 0; i < tor->peerCount; i++ )
     {
-        tr_err( "chooseBlock: block=%d shoud not be possible", block );
+        if( ops[i] > -1 )
+        {
+            tor->peers[i]->inResult = tr_netResult( u, ops[i], 1 );
+        }
+    }
+}
+
+/***********************************************************************
+ * sendBatch
+ ***********************************************************************
+ * Sends what we have for every peer with a single system call. Like
+ * sendData, small messages always go, but data only goes as far as the
+ * upload limit lets us: the sends queued for the peers before count
+ * against it, as they are only accounted once they are done.
+ **********************************************************************/
+static void sendBatch( tr_torrent_t * tor, tr_uring_t * u )
+{
+    tr_peer_t * peer;
+    int         i, ret, size, queued = 0, pending = 0;
+    int         ops[TR_MAX_PEER_COUNT];
+    char        drop[TR_MAX_PEER_COUNT];
+
+    for( i = 0; i < tor->peerCount; i++ )
+    {
+        peer    = tor->peers[i];
+        ops[i]  = -1;
+        drop[i] = 0;
+        if( peer->outPos < 1 )
+        {
+            continue;
+        }
+        size = peer->outPos;
+        if( size > 100 )
+        {
+            size = MIN( size, tr_uploadAllowance( tor->upload ) -
+                              pending );
+            if( size < 1 )
+            {
+                continue;
+            }
+        }
+        ops[i] = tr_uringSend( u, peer->socket, peer->outBuf, size );
+        if( ops[i] < 0 )
+        {
+            /* No room left, or the kernel can't do it */
+            drop[i] = sendData( tor, peer );
+            continue;
+        }
+        queued   = 1;
+        pending += size;
+    }
+    if( queued )
+    {
+        tr_uringSubmit( u );
+    }
+
+    /* Backwards, so dropping a peer doesn't move those left to check */
+    for( i = tor->peerCount - 1; i >= 0; i-- )
+    {
+        peer = tor->peers[i];
+        if( ops[i] > -1 )
+        {
+            ret = tr_netResult( u, ops[i], 0 );
+            if( ret & TR_NET_CLOSE )
+            {
+                drop[i] = 1;
+            }
+            else if( !( ret & TR_NET_BLOCK ) )
+            {
+                sentData( tor, peer, ret );
+            }
+        }
+        if( drop[i] )
+        {
+            tr_peerRem( tor, i );
+        }
     }
-    
-    return block;
 }
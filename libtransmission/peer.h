@@ -34,5 +34,6 @@ int         tr_peerIsConnected   ( tr_peer_t * );
 int         tr_peerIsUploading   ( tr_peer_t * );
 int         tr_peerIsDownloading ( tr_peer_t * );
 uint8_t *   tr_peerBitfield      ( tr_peer_t * );
+void        tr_peerSendHave      ( tr_torrent_t *, int );
 
 #endif
@@ -0,0 +1,295 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/* Size of the hash table */
+#define POOL_BUCKETS    256
+
+/* Maximum number of peers we remember per torrent */
+#define POOL_MAX        1000
+
+/* After a failed attempt, wait 30 seconds, then 1 minute, 2 minutes...
+   up to about 1 hour. Give up after POOL_MAX_FAILS attempts */
+#define POOL_BACKOFF    30000
+#define POOL_MAX_FAILS  8
+
+/* Wait 1 minute before connecting again to a peer we dropped */
+#define POOL_RECONNECT  60000
+
+typedef struct tr_candidate_s
+{
+    struct in_addr          addr;
+    in_port_t               port;
+    int                     from;      /* POOL_FROM_* */
+
+    char                    connected; /* We have a tr_peer_t for it */
+    int                     failures;  /* Failed attempts in a row */
+    uint64_t                retryDate; /* Don't try again before */
+    float                   score;     /* KB/s exchanged in the past */
+
+    struct tr_candidate_s * next;      /* Next in the same bucket */
+}
+tr_candidate_t;
+
+struct tr_peerpool_s
+{
+    int              count;
+    int              failing; /* Candidates with failures */
+    tr_candidate_t * buckets[POOL_BUCKETS];
+};
+
+static tr_candidate_t ** findCandidate( tr_peerpool_t *, struct in_addr,
+                                        in_port_t );
+static void              removeCandidate( tr_peerpool_t *,
+                                          tr_candidate_t ** );
+static int               isBetter( tr_candidate_t *, tr_candidate_t * );
+
+tr_peerpool_t * tr_peerpoolInit()
+{
+    return calloc( sizeof( tr_peerpool_t ), 1 );
+}
+
+/***********************************************************************
+ * tr_peerpoolAdd
+ ***********************************************************************
+ * Remembers a peer we may connect to later. Does nothing if we already
+ * know it. If the pool is full, forgets the worst peer we are not
+ * connected to if it failed us, otherwise forgets the new one: it is no
+ * better than those we never tried.
+ **********************************************************************/
+void tr_peerpoolAdd( tr_peerpool_t * pool, struct in_addr addr,
+                     in_port_t port, int from )
+{
+    tr_candidate_t ** pc, ** worst;
+    tr_candidate_t  * c;
+    int               i;
+
+    if( *findCandidate( pool, addr, port ) )
+    {
+        return;
+    }
+
+    if( pool->count >= POOL_MAX )
+    {
+        if( !pool->failing )
+        {
+            /* Don't bother looking */
+            return;
+        }
+        worst = NULL;
+        for( i = 0; i < POOL_BUCKETS; i++ )
+        {
+            for( pc = &pool->buckets[i]; *pc; pc = &(*pc)->next )
+            {
+                if( (*pc)->connected )
+                {
+                    continue;
+                }
+                if( !worst || isBetter( *worst, *pc ) )
+                {
+                    worst = pc;
+                }
+            }
+        }
+        if( !worst || !(*worst)->failures )
+        {
+            /* Everyone is worth keeping */
+            return;
+        }
+        removeCandidate( pool, worst );
+    }
+
+    c       = calloc( sizeof( tr_candidate_t ), 1 );
+    c->addr = addr;
+    c->port = port;
+    c->from = from;
+
+    pc      = findCandidate( pool, addr, port );
+    *pc     = c;
+    (pool->count)++;
+}
+
+/***********************************************************************
+ * tr_peerpoolNext
+ ***********************************************************************
+ * Picks the best peer we are not connected to and may try now, and
+ * marks it connected. Returns 0 and fills 'addr' and 'port' if there
+ * is one, 1 otherwise.
+ **********************************************************************/
+int tr_peerpoolNext( tr_peerpool_t * pool, struct in_addr * addr,
+                     in_port_t * port )
+{
+    tr_candidate_t * c, * best = NULL;
+    uint64_t         now = tr_date();
+    int              i;
+
+    for( i = 0; i < POOL_BUCKETS; i++ )
+    {
+        for( c = pool->buckets[i]; c; c = c->next )
+        {
+            if( c->connected || c->retryDate > now )
+            {
+                continue;
+            }
+            if( !best || isBetter( c, best ) )
+            {
+                best = c;
+            }
+        }
+    }
+
+    if( !best )
+    {
+        return 1;
+    }
+
+    best->connected = 1;
+    *addr           = best->addr;
+    *port           = best->port;
+
+    return 0;
+}
+
+/***********************************************************************
+ * tr_peerpoolDone
+ ***********************************************************************
+ * We are not connected to this peer anymore. 'ok' tells whether we
+ * managed to get its handshake, and 'rate' how fast we exchanged data
+ * with it (KB/s).
+ **********************************************************************/
+void tr_peerpoolDone( tr_peerpool_t * pool, struct in_addr addr,
+                      in_port_t port, int ok, float rate )
+{
+    tr_candidate_t ** pc;
+    tr_candidate_t  * c;
+
+    pc = findCandidate( pool, addr, port );
+    if( !( c = *pc ) )
+    {
+        return;
+    }
+
+    c->connected = 0;
+
+    if( ok )
+    {
+        if( c->failures )
+        {
+            (pool->failing)--;
+        }
+        c->failures  = 0;
+        c->retryDate = tr_date() + POOL_RECONNECT;
+        c->score     = ( c->score + rate ) / 2.0;
+        return;
+    }
+
+    if( !c->failures )
+    {
+        (pool->failing)++;
+    }
+    (c->failures)++;
+    if( c->failures >= POOL_MAX_FAILS )
+    {
+        tr_dbg( "%08x:%04x failed %d times, forgetting it",
+                addr.s_addr, port, c->failures );
+        removeCandidate( pool, pc );
+        return;
+    }
+    c->retryDate = tr_date() +
+        ( (uint64_t) POOL_BACKOFF << ( c->failures - 1 ) );
+}
+
+int tr_peerpoolCount( tr_peerpool_t * pool )
+{
+    return pool->count;
+}
+
+void tr_peerpoolClose( tr_peerpool_t * pool )
+{
+    int i;
+
+    for( i = 0; i < POOL_BUCKETS; i++ )
+    {
+        while( pool->buckets[i] )
+        {
+            removeCandidate( pool, &pool->buckets[i] );
+        }
+    }
+    free( pool );
+}
+
+/***********************************************************************
+ * findCandidate
+ ***********************************************************************
+ * Returns a pointer to the link pointing to the candidate matching
+ * 'addr' and 'port', or to the NULL link at the end of the bucket if
+ * there is none.
+ **********************************************************************/
+static tr_candidate_t ** findCandidate( tr_peerpool_t * pool,
+                                        struct in_addr addr,
+                                        in_port_t port )
+{
+    tr_candidate_t ** pc;
+    uint32_t          hash;
+
+    hash = ntohl( addr.s_addr ) * 2654435761U + port;
+    hash = ( hash ^ ( hash >> 16 ) ) % POOL_BUCKETS;
+
+    for( pc = &pool->buckets[hash]; *pc; pc = &(*pc)->next )
+    {
+        if( (*pc)->addr.s_addr == addr.s_addr && (*pc)->port == port )
+        {
+            break;
+        }
+    }
+
+    return pc;
+}
+
+static void removeCandidate( tr_peerpool_t * pool, tr_candidate_t ** pc )
+{
+    tr_candidate_t * c = *pc;
+
+    *pc = c->next;
+    if( c->failures )
+    {
+        (pool->failing)--;
+    }
+    free( c );
+    (pool->count)--;
+}
+
+/***********************************************************************
+ * isBetter
+ ***********************************************************************
+ * Peers we exchanged data with come first, fastest ones first. Then
+ * those we never tried, then those which failed, least failures first.
+ **********************************************************************/
+static int isBetter( tr_candidate_t * c1, tr_candidate_t * c2 )
+{
+    if( c1->failures != c2->failures )
+    {
+        return c1->failures < c2->failures;
+    }
+    return c1->score > c2->score;
+}
@@ -0,0 +1,41 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TR_PEERPOOL_H
+#define TR_PEERPOOL_H 1
+
+typedef struct tr_peerpool_s tr_peerpool_t;
+
+/* Where we heard about a peer */
+#define POOL_FROM_TRACKER 1
+
+tr_peerpool_t * tr_peerpoolInit   ();
+void            tr_peerpoolAdd    ( tr_peerpool_t *, struct in_addr,
+                                    in_port_t, int );
+int             tr_peerpoolNext   ( tr_peerpool_t *, struct in_addr *,
+                                    in_port_t * );
+void            tr_peerpoolDone   ( tr_peerpool_t *, struct in_addr,
+                                    in_port_t, int, float );
+int             tr_peerpoolCount  ( tr_peerpool_t * );
+void            tr_peerpoolClose  ( tr_peerpool_t * );
+
+#endif
@@ -23,6 +23,7 @@
 #include "peerutils.h"
 
 static void checkOutSize( tr_peer_t *, int );
+static void sendHave( tr_peer_t *, int );
 
 /***********************************************************************
  * tr_peerInit
@@ -45,6 +46,8 @@ tr_peer_t * tr_peerInit( tr_torrent_t * tor )
     peer->peerChoking = 1;
     peer->date        = tr_date();
     peer->keepAlive   = peer->date;
+    peer->offeredPiece = -1;
+    peer->maxRequest   = tor->blockSize;
 
     tor->peers[tor->peerCount++] = peer;
     return peer;
@@ -65,34 +68,13 @@ int tr_peerCmp( tr_peer_t * peer1, tr_peer_t * peer2 )
 /***********************************************************************
  * tr_peerAddWithAddr
  ***********************************************************************
- * Does nothing if we already have a peer matching 'addr' and 'port'.
- * Otherwise adds such a new peer.
+ * Remembers a peer we may connect to. The connection itself is made
+ * later, once there is room for it.
  **********************************************************************/
 void tr_peerAddWithAddr( tr_torrent_t * tor, struct in_addr addr,
                              in_port_t port )
 {
-    int i;
-    tr_peer_t * peer;
-
-    for( i = 0; i < tor->peerCount; i++ )
-    {
-        peer = tor->peers[i];
-        if( peer->addr.s_addr == addr.s_addr &&
-            peer->port        == port )
-        {
-            /* We are already connected to this peer */
-            return;
-        }
-    }
-
-    if( !( peer = tr_peerInit( tor ) ) )
-    {
-        return;
-    }
-
-    peer->addr   = addr;
-    peer->port   = port;
-    peer->status = PEER_STATUS_IDLE;
+    tr_peerpoolAdd( tor->pool, addr, port, POOL_FROM_TRACKER );
 }
 
 /***********************************************************************
@@ -171,12 +153,11 @@ void tr_peerSendInterest( tr_peer_t * peer, int yes )
 /***********************************************************************
  * tr_peerSendHave
  ***********************************************************************
- * 
+ * Tells all connected peers that we have 'piece'
  **********************************************************************/
 void tr_peerSendHave( tr_torrent_t * tor, int piece )
 {
     int i;
-    char * p;
     tr_peer_t * peer;
 
     for( i = 0; i < tor->peerCount; i++ )
@@ -188,18 +169,93 @@ void tr_peerSendHave( tr_torrent_t * tor, int piece )
             continue;
         }
 
-        checkOutSize( peer, 9 );
-        p = &peer->outBuf[peer->outPos];
+        sendHave( peer, piece );
+    }
+}
 
-        TR_HTONL( 5, &p[0] );
-        p[4] = 4;
-        TR_HTONL( piece, &p[5] );
+/***********************************************************************
+ * tr_peerSuperSeeding
+ ***********************************************************************
+ * Returns 1 if we are seeding and should only reveal pieces one at a
+ * time, 0 otherwise
+ **********************************************************************/
+int tr_peerSuperSeeding( tr_torrent_t * tor )
+{
+    return tor->superSeed && tor->blockHaveCount >= tor->blockCount;
+}
 
-        peer->outPos += 9;
+/***********************************************************************
+ * tr_peerSendOffer
+ ***********************************************************************
+ * Super-seeding: picks a piece for this peer and tells him we have it,
+ * and only it. We choose among the pieces he doesn't have the one the
+ * fewest peers have, avoiding pieces we already offered to others.
+ **********************************************************************/
+void tr_peerSendOffer( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    tr_info_t * inf = &tor->info;
+    int       * offers;
+    int         i, piece, score, minScore;
 
-        tr_dbg( "%08x:%04x SEND have %d", peer->addr.s_addr,
-                peer->port, piece );
+    /* Count how many peers are currently waiting on each piece */
+    offers = calloc( inf->pieceCount, sizeof( int ) );
+    for( i = 0; i < tor->peerCount; i++ )
+    {
+        if( tor->peers[i]->offered && tor->peers[i]->offeredPiece > -1 )
+        {
+            (offers[tor->peers[i]->offeredPiece])++;
+        }
     }
+
+    piece    = -1;
+    minScore = INT_MAX;
+    for( i = 0; i < inf->pieceCount; i++ )
+    {
+        if( tr_bitfieldHas( peer->offered, i ) ||
+            ( peer->bitfield && tr_bitfieldHas( peer->bitfield, i ) ) )
+        {
+            continue;
+        }
+        score = 2 * tor->pieceAvail[i] + offers[i];
+        if( score < minScore )
+        {
+            piece    = i;
+            minScore = score;
+        }
+    }
+    free( offers );
+
+    peer->offeredPiece = piece;
+    if( piece < 0 )
+    {
+        /* He has, or was offered, everything already */
+        return;
+    }
+
+    tr_bitfieldAdd( peer->offered, piece );
+    sendHave( peer, piece );
+}
+
+/***********************************************************************
+ * tr_peerStopOffering
+ ***********************************************************************
+ * Leaves super-seeding for this peer: tells him about all the pieces
+ * we had been hiding
+ **********************************************************************/
+void tr_peerStopOffering( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    int i;
+
+    for( i = 0; i < tor->info.pieceCount; i++ )
+    {
+        if( tr_bitfieldHas( tor->bitfield, i ) &&
+            !tr_bitfieldHas( peer->offered, i ) )
+        {
+            sendHave( peer, i );
+        }
+    }
+    free( peer->offered );
+    peer->offered = NULL;
 }
 
 /***********************************************************************
@@ -227,6 +283,39 @@ void tr_peerSendBitfield( tr_torrent_t * tor, tr_peer_t * peer )
     tr_dbg( "%08x:%04x SEND bitfield", peer->addr.s_addr, peer->port );
 }
 
+/***********************************************************************
+ * tr_peerSendExtended
+ ***********************************************************************
+ * Sends the extension protocol handshake. We don't support any
+ * extension message, but tell the peer how many requests we queue and
+ * how large they may be.
+ **********************************************************************/
+void tr_peerSendExtended( tr_torrent_t * tor, tr_peer_t * peer )
+{
+    char   dict[128];
+    int    len;
+    char * p;
+
+    len = snprintf( dict, sizeof( dict ),
+                    "d1:mde4:reqqi%de7:reqsizei%de1:v%d:Transmission %se",
+                    tr_uploadQueueDepth( tor->upload ),
+                    tr_uploadRequestSize( tor->upload ),
+                    13 + (int) strlen( TR_VERSION ), TR_VERSION );
+
+    checkOutSize( peer, 6 + len );
+    p = &peer->outBuf[peer->outPos];
+
+    TR_HTONL( 2 + len, p );
+    p[4] = 20;
+    p[5] = 0;
+    memcpy( &p[6], dict, len );
+
+    peer->outPos += 6 + len;
+
+    tr_dbg( "%08x:%04x SEND extended handshake", peer->addr.s_addr,
+            peer->port );
+}
+
 /***********************************************************************
  * tr_peerSendRequest
  ***********************************************************************
@@ -234,23 +323,31 @@ void tr_peerSendBitfield( tr_torrent_t * tor, tr_peer_t * peer )
  **********************************************************************/
 void tr_peerSendRequest( tr_torrent_t * tor, tr_peer_t * peer, int block )
 {
-    tr_info_t * inf = &tor->info;
     tr_request_t * r;
     char * p;
+    int i, endBlock, maxLength;
 
     /* Get the piece the block is a part of, its position in the piece
        and its size */
     r         = &peer->inRequests[peer->inRequestCount];
-    r->index  = block / ( inf->pieceSize / tor->blockSize );
-    r->begin  = ( block % ( inf->pieceSize / tor->blockSize ) ) *
-                    tor->blockSize;
-    r->length = tor->blockSize;
-    if( block == tor->blockCount - 1 )
+    r->index  = tr_blockPiece( block );
+    r->begin  = tr_blockPosInPiece( block );
+    r->length = tr_blockSize( block );
+
+    /* If the peer accepts larger requests, extend it with the
+       following blocks of the piece nobody is sending us yet (unless
+       this is an end game request) */
+    if( !tor->blockHave[block] )
     {
-        int lastSize = inf->totalSize % tor->blockSize;
-        if( lastSize )
+        maxLength = MIN( peer->maxRequest,
+                         tr_uploadRequestSize( tor->upload ) );
+        endBlock  = tr_pieceStartBlock( r->index ) +
+                        tr_pieceCountBlocks( r->index );
+        for( i = block + 1; i < endBlock && !tor->blockHave[i] &&
+                 r->length + tr_blockSize( i ) <= maxLength; i++ )
         {
-            r->length = lastSize;
+            r->length += tr_blockSize( i );
+            (tor->blockHave[i])++;
         }
     }
     (peer->inRequestCount)++;
@@ -267,7 +364,8 @@ void tr_peerSendRequest( tr_torrent_t * tor, tr_peer_t * peer, int block )
 
     peer->outPos += 17;
 
-    /* Remember that we have one more uploader for this block */
+    /* Remember that we have one more uploader for this block (the
+       following ones were counted above) */
     (tor->blockHave[block])++;
 
     tr_dbg( "%08x:%04x SEND request %d/%d (%d bytes)",
@@ -278,14 +376,25 @@ void tr_peerSendRequest( tr_torrent_t * tor, tr_peer_t * peer, int block )
 /***********************************************************************
  * tr_peerSendPiece
  ***********************************************************************
- *
+ * Sends the first block the peer asked for, unless it isn't in memory:
+ * then we have it read in the background and wait for it. We only
+ * read it ourselves if the background read couldn't bring it.
  **********************************************************************/
 void tr_peerSendPiece( tr_torrent_t * tor, tr_peer_t * peer )
 {
-    char * p;
+    tr_info_t * inf = &tor->info;
+    char      * p;
+    uint64_t    offset;
+    int         half, ret;
 
     tr_request_t * r = &peer->outRequests[0];
 
+    if( r->loading && tr_ioLoading( tor->io, r->index ) )
+    {
+        /* Still on its way */
+        return;
+    }
+
     checkOutSize( peer, 13 + r->length );
     p = &peer->outBuf[peer->outPos];
 
@@ -293,7 +402,31 @@ void tr_peerSendPiece( tr_torrent_t * tor, tr_peer_t * peer )
     p[4] = 7;
     TR_HTONL( r->index, p + 5 );
     TR_HTONL( r->begin, p + 9 );
-    tr_ioRead( tor->io, r->index, r->begin, r->length, &p[13] );
+    if( r->loading )
+    {
+        /* The load is over but the data isn't there: it failed or was
+           evicted already */
+        ret = tr_ioRead( tor->io, r->index, r->begin, r->length, &p[13] );
+    }
+    else
+    {
+        ret = tr_ioTryRead( tor->io, r->index, r->begin, r->length,
+                            &p[13] );
+    }
+    if( ret == 2 )
+    {
+        r->loading = 1;
+        return;
+    }
+    if( ret )
+    {
+        /* Don't send garbage, forget about this request */
+        tr_err( "Piece %d: read failed", r->index );
+        (peer->outRequestCount)--;
+        memmove( &peer->outRequests[0], &peer->outRequests[1],
+                 peer->outRequestCount * sizeof( tr_request_t ) );
+        return;
+    }
 
     peer->outPos += 13 + r->length;
 
@@ -301,11 +434,74 @@ void tr_peerSendPiece( tr_torrent_t * tor, tr_peer_t * peer )
             peer->addr.s_addr, peer->port,
             r->index, r->begin, r->length );
 
+    /* If the peer reads in order, have the next piece in memory by the
+       time it gets there */
+    offset = (uint64_t) r->index * (uint64_t) inf->pieceSize +
+             (uint64_t) r->begin;
+    half   = tr_pieceSize( r->index ) / 2;
+    if( offset == peer->outNext && r->begin < half &&
+        r->begin + r->length >= half && r->index + 1 < inf->pieceCount &&
+        tr_bitfieldHas( tor->bitfield, r->index + 1 ) &&
+        ( !peer->bitfield ||
+          !tr_bitfieldHas( peer->bitfield, r->index + 1 ) ) )
+    {
+        tr_ioPrefetch( tor->io, r->index + 1 );
+    }
+    peer->outNext = offset + (uint64_t) r->length;
+
     (peer->outRequestCount)--;
     memmove( &peer->outRequests[0], &peer->outRequests[1],
              peer->outRequestCount * sizeof( tr_request_t ) );
 }
 
+/***********************************************************************
+ * tr_peerQueueRequest
+ ***********************************************************************
+ * Remembers that the peer asked us for a block. The queue grows as
+ * needed, up to the depth allowed by the upload settings. Returns 1 if
+ * the queue is full, 0 otherwise.
+ **********************************************************************/
+int tr_peerQueueRequest( tr_torrent_t * tor, tr_peer_t * peer,
+                         int index, int begin, int length )
+{
+    tr_request_t * r;
+    int            i;
+
+    for( i = 0; i < peer->outRequestCount; i++ )
+    {
+        r = &peer->outRequests[i];
+        if( r->index == index && r->begin == begin &&
+            r->length == length )
+        {
+            /* Already queued */
+            return 0;
+        }
+    }
+
+    if( peer->outRequestCount >= tr_uploadQueueDepth( tor->upload ) )
+    {
+        return 1;
+    }
+
+    if( peer->outRequestCount >= peer->outRequestMax )
+    {
+        peer->outRequestMax = peer->outRequestMax ?
+            2 * peer->outRequestMax : MAX_REQUEST_COUNT;
+        peer->outRequests   = realloc( peer->outRequests,
+            peer->outRequestMax * sizeof( tr_request_t ) );
+    }
+
+    r          = &peer->outRequests[peer->outRequestCount];
+    r->index   = index;
+    r->begin   = begin;
+    r->length  = length;
+    r->loading = 0;
+
+    (peer->outRequestCount)++;
+
+    return 0;
+}
+
 #if 0
 /***********************************************************************
  * tr_peerSendCancel
@@ -356,6 +552,23 @@ int tr_peerSendCancel( tr_torrent_t * tor, tr_peer_t * peer )
 }
 #endif
 
+static void sendHave( tr_peer_t * peer, int piece )
+{
+    char * p;
+
+    checkOutSize( peer, 9 );
+    p = &peer->outBuf[peer->outPos];
+
+    TR_HTONL( 5, &p[0] );
+    p[4] = 4;
+    TR_HTONL( piece, &p[5] );
+
+    peer->outPos += 9;
+
+    tr_dbg( "%08x:%04x SEND have %d", peer->addr.s_addr,
+            peer->port, piece );
+}
+
 static void checkOutSize( tr_peer_t * peer, int size )
 {
     if( peer->outSize < 1 )
@@ -25,13 +25,18 @@
 
 #include "transmission.h"
 
-#define MAX_REQUEST_COUNT 16
+#define MAX_REQUEST_COUNT  16
+
+/* Sequential mode: pieces due within this many milliseconds are also
+   requested from other fast peers */
+#define STREAM_URGENT      5000
 
 typedef struct tr_request_s
 {
     int index;
     int begin;
     int length;
+    int loading; /* We are reading it in the background */
 
 } tr_request_t;
 
@@ -40,13 +45,15 @@ struct tr_peer_s
     struct in_addr addr;
     in_port_t      port;
 
-#define PEER_STATUS_IDLE       1 /* Need to connect */
+#define PEER_STATUS_OPENING    1 /* Waiting for connect() to complete */
 #define PEER_STATUS_CONNECTING 2 /* Trying to send handshake */
 #define PEER_STATUS_HANDSHAKE  4 /* Waiting for peer's handshake */
 #define PEER_STATUS_CONNECTED  8 /* Got peer's handshake */
     int            status;
     int            socket;
+    char           incoming;
     uint64_t       date;
+    uint64_t       connectDate;
     uint64_t       keepAlive;
 
     char           amChoking;
@@ -57,9 +64,15 @@ struct tr_peer_s
     uint8_t        id[20];
     uint8_t      * bitfield;
 
+    /* The peer speaks the extension protocol, and the largest request
+       it told us it accepts */
+    char           extended;
+    int            maxRequest;
+
     char         * buf;
     int            size;
     int            pos;
+    int            inResult; /* What recvBatch got, 0 if nothing */
 
     char         * outBuf;
     int            outSize;
@@ -73,7 +86,14 @@ struct tr_peer_s
     uint64_t       inTotal;
 
     int            outRequestCount;
-    tr_request_t   outRequests[MAX_REQUEST_COUNT];
+    int            outRequestMax;
+    tr_request_t * outRequests;
+    uint64_t       outNext; /* Where the last block we sent ends */
+
+    /* Super-seeding: pieces we told this peer we have, and the one we
+       are waiting for him to share */
+    uint8_t      * offered;
+    int            offeredPiece;
     uint64_t       outTotal;
     uint64_t       outDate;
     int            outSlow;
@@ -86,10 +106,15 @@ void        tr_peerAddWithAddr   ( tr_torrent_t *, struct in_addr,
 void        tr_peerSendKeepAlive ( tr_peer_t * );
 void        tr_peerSendChoke     ( tr_peer_t *, int );
 void        tr_peerSendInterest  ( tr_peer_t *, int );
-void        tr_peerSendHave      ( tr_torrent_t *, int );
+int         tr_peerSuperSeeding  ( tr_torrent_t * );
+void        tr_peerSendOffer     ( tr_torrent_t *, tr_peer_t * );
+void        tr_peerStopOffering  ( tr_torrent_t *, tr_peer_t * );
 void        tr_peerSendBitfield  ( tr_torrent_t *, tr_peer_t * );
+void        tr_peerSendExtended  ( tr_torrent_t *, tr_peer_t * );
 void        tr_peerSendRequest   ( tr_torrent_t *, tr_peer_t *, int );
 void        tr_peerSendPiece     ( tr_torrent_t *, tr_peer_t * );
+int         tr_peerQueueRequest  ( tr_torrent_t *, tr_peer_t *,
+                                   int, int, int );
 void        tr_peerSendCancel    ( tr_torrent_t *, tr_peer_t * );
 
 #endif
@@ -0,0 +1,236 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+typedef struct tr_read_s
+{
+    uint64_t           offset;
+    int                length;
+    uint8_t          * buf;
+    void            (* callback)( void *, int );
+    void             * data;
+
+    /* Pieces we need to complete the read */
+    int                first;
+    int                last;
+
+    struct tr_read_s * next;
+}
+tr_read_t;
+
+struct tr_reader_s
+{
+    tr_torrent_t * tor;
+    tr_read_t    * reads;
+};
+
+static int  isReady( tr_reader_t *, tr_read_t * );
+static void serve( tr_reader_t *, tr_read_t * );
+
+/***********************************************************************
+ * tr_readerInit
+ ***********************************************************************
+ * Reads are queued per torrent. All functions must be called with the
+ * torrent locked.
+ **********************************************************************/
+tr_reader_t * tr_readerInit( tr_torrent_t * tor )
+{
+    tr_reader_t * r;
+
+    r      = calloc( sizeof( tr_reader_t ), 1 );
+    r->tor = tor;
+
+    return r;
+}
+
+/***********************************************************************
+ * tr_readerAdd
+ ***********************************************************************
+ * Queues a read of 'length' bytes at 'offset' in the torrent. If the
+ * pieces are already there, it is served right away. Returns 1 if the
+ * range is invalid, 0 otherwise.
+ **********************************************************************/
+int tr_readerAdd( tr_reader_t * r, uint64_t offset, int length,
+                  uint8_t * buf, void (*callback)( void *, int ),
+                  void * data )
+{
+    tr_info_t * inf = &r->tor->info;
+    tr_read_t * read, ** prev;
+
+    if( length < 1 || offset > inf->totalSize ||
+        (uint64_t) length > inf->totalSize - offset )
+    {
+        return 1;
+    }
+
+    read           = calloc( sizeof( tr_read_t ), 1 );
+    read->offset   = offset;
+    read->length   = length;
+    read->buf      = buf;
+    read->callback = callback;
+    read->data     = data;
+    read->first    = offset / inf->pieceSize;
+    read->last     = ( offset + length - 1 ) / inf->pieceSize;
+
+    if( isReady( r, read ) )
+    {
+        serve( r, read );
+        return 0;
+    }
+
+    /* Oldest first */
+    for( prev = &r->reads; *prev; prev = &(*prev)->next );
+    *prev = read;
+
+    return 0;
+}
+
+/***********************************************************************
+ * tr_readerRange
+ ***********************************************************************
+ * Gets the pieces covered by the i-th pending read, so we can download
+ * them first. Returns 1 if there are less than i+1 pending reads.
+ **********************************************************************/
+int tr_readerRange( tr_reader_t * r, int i, int * first, int * last )
+{
+    tr_read_t * read;
+
+    for( read = r->reads; read && i > 0; read = read->next, i-- );
+    if( !read )
+    {
+        return 1;
+    }
+
+    *first = read->first;
+    *last  = read->last;
+
+    return 0;
+}
+
+/***********************************************************************
+ * tr_readerPulse
+ ***********************************************************************
+ * Serves the reads for which all pieces have been verified
+ **********************************************************************/
+void tr_readerPulse( tr_reader_t * r )
+{
+    tr_read_t ** prev, * read;
+
+    for( prev = &r->reads; *prev; )
+    {
+        read = *prev;
+        if( !isReady( r, read ) )
+        {
+            prev = &read->next;
+            continue;
+        }
+        *prev = read->next;
+        serve( r, read );
+    }
+}
+
+/***********************************************************************
+ * tr_readerFail
+ ***********************************************************************
+ * The torrent is being stopped: gives up all pending reads
+ **********************************************************************/
+void tr_readerFail( tr_reader_t * r )
+{
+    tr_read_t * read;
+
+    while( ( read = r->reads ) )
+    {
+        r->reads = read->next;
+        read->callback( read->data, 1 );
+        free( read );
+    }
+}
+
+void tr_readerClose( tr_reader_t * r )
+{
+    tr_readerFail( r );
+    free( r );
+}
+
+/***********************************************************************
+ * isReady
+ ***********************************************************************
+ * Returns 1 if the torrent is running and we have every piece the read
+ * covers
+ **********************************************************************/
+static int isReady( tr_reader_t * r, tr_read_t * read )
+{
+    tr_torrent_t * tor = r->tor;
+    int            i;
+
+    if( !tor->io || !( tor->status & ( TR_STATUS_DOWNLOAD |
+                                       TR_STATUS_SEED ) ) )
+    {
+        return 0;
+    }
+
+    for( i = read->first; i <= read->last; i++ )
+    {
+        if( !tr_bitfieldHas( tor->bitfield, i ) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/***********************************************************************
+ * serve
+ ***********************************************************************
+ * Copies the data piece by piece, calls back and frees the read
+ **********************************************************************/
+static void serve( tr_reader_t * r, tr_read_t * read )
+{
+    tr_torrent_t * tor = r->tor;
+    tr_info_t    * inf = &tor->info;
+    uint64_t       offset = read->offset;
+    uint8_t      * buf    = read->buf;
+    int            left   = read->length;
+    int            index, begin, length, ret = 0;
+
+    while( left > 0 )
+    {
+        index  = offset / inf->pieceSize;
+        begin  = offset % inf->pieceSize;
+        length = MIN( left, tr_pieceSize( index ) - begin );
+
+        if( tr_ioRead( tor->io, index, begin, length, (char *) buf ) )
+        {
+            ret = 1;
+            break;
+        }
+
+        offset += length;
+        buf    += length;
+        left   -= length;
+    }
+
+    read->callback( read->data, ret );
+    free( read );
+}
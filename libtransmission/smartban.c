@@ -0,0 +1,259 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+/***********************************************************************
+ * Smart ban
+ ***********************************************************************
+ * We remember which peer sent us each block. When a piece fails its
+ * hash check, we store the hash of each of its blocks along with the
+ * peer it came from. Once the piece eventually passes, blocks which
+ * differ from the good ones tell us who sent us garbage.
+ * If all blocks of a failed piece come from the same peer, we don't
+ * need to wait: that peer is guilty.
+ **********************************************************************/
+
+/* Don't remember more than that many suspicious blocks */
+#define MAX_RECORDS 1024
+
+typedef struct tr_record_s
+{
+    int            block;
+    struct in_addr addr;
+    uint8_t        hash[SHA_DIGEST_LENGTH];
+}
+tr_record_t;
+
+struct tr_ban_s
+{
+    tr_torrent_t   * tor;
+
+    /* Who sent us each block */
+    struct in_addr * blockFrom;
+
+    /* Blocks from pieces which failed */
+    int              recordCount;
+    tr_record_t    * records;
+
+    /* Peers we won't talk to anymore */
+    int              bannedCount;
+    int              bannedMax;
+    struct in_addr * banned;
+};
+
+static void ban( tr_ban_t *, struct in_addr );
+
+tr_ban_t * tr_banInit( tr_torrent_t * tor )
+{
+    tr_ban_t * b;
+
+    b            = calloc( sizeof( tr_ban_t ), 1 );
+    b->tor       = tor;
+    b->blockFrom = calloc( tor->blockCount, sizeof( struct in_addr ) );
+    b->records   = malloc( MAX_RECORDS * sizeof( tr_record_t ) );
+
+    return b;
+}
+
+/***********************************************************************
+ * tr_banBlockFrom
+ ***********************************************************************
+ * Remembers that 'block' was sent by 'addr'
+ **********************************************************************/
+void tr_banBlockFrom( tr_ban_t * b, int block, struct in_addr addr )
+{
+    b->blockFrom[block] = addr;
+}
+
+/***********************************************************************
+ * tr_banPieceFailed
+ ***********************************************************************
+ * 'buf' holds the data which failed the hash check
+ **********************************************************************/
+void tr_banPieceFailed( tr_ban_t * b, int piece, uint8_t * buf )
+{
+    tr_torrent_t * tor = b->tor;
+    tr_record_t  * r;
+    int            i, j, startBlock, endBlock, sameSender;
+
+    startBlock = tr_pieceStartBlock( piece );
+    endBlock   = startBlock + tr_pieceCountBlocks( piece );
+
+    sameSender = 1;
+    for( i = startBlock + 1; i < endBlock; i++ )
+    {
+        if( b->blockFrom[i].s_addr != b->blockFrom[startBlock].s_addr )
+        {
+            sameSender = 0;
+            break;
+        }
+    }
+    if( sameSender )
+    {
+        ban( b, b->blockFrom[startBlock] );
+        return;
+    }
+
+    for( i = startBlock; i < endBlock; i++ )
+    {
+        if( b->recordCount >= MAX_RECORDS )
+        {
+            /* Forget the oldest one */
+            (b->recordCount)--;
+            memmove( &b->records[0], &b->records[1],
+                     b->recordCount * sizeof( tr_record_t ) );
+        }
+
+        r        = &b->records[b->recordCount];
+        r->block = i;
+        r->addr  = b->blockFrom[i];
+        SHA1( &buf[tr_blockPosInPiece( i )], tr_blockSize( i ), r->hash );
+
+        for( j = 0; j < b->recordCount; j++ )
+        {
+            if( b->records[j].block == r->block &&
+                b->records[j].addr.s_addr == r->addr.s_addr &&
+                !memcmp( b->records[j].hash, r->hash,
+                         SHA_DIGEST_LENGTH ) )
+            {
+                /* Same peer sent us the same data again */
+                break;
+            }
+        }
+        if( j >= b->recordCount )
+        {
+            (b->recordCount)++;
+        }
+    }
+}
+
+/***********************************************************************
+ * tr_banPiecePassed
+ ***********************************************************************
+ * 'buf' holds the good data. Compare it to what we got before
+ **********************************************************************/
+void tr_banPiecePassed( tr_ban_t * b, int piece, uint8_t * buf )
+{
+    tr_torrent_t * tor = b->tor;
+    tr_record_t  * r;
+    int            i, startBlock, endBlock;
+    uint8_t        hash[SHA_DIGEST_LENGTH];
+
+    startBlock = tr_pieceStartBlock( piece );
+    endBlock   = startBlock + tr_pieceCountBlocks( piece );
+
+    for( i = 0; i < b->recordCount; )
+    {
+        r = &b->records[i];
+        if( r->block < startBlock || r->block >= endBlock )
+        {
+            i++;
+            continue;
+        }
+
+        SHA1( &buf[tr_blockPosInPiece( r->block )],
+              tr_blockSize( r->block ), hash );
+        if( memcmp( hash, r->hash, SHA_DIGEST_LENGTH ) )
+        {
+            ban( b, r->addr );
+        }
+
+        (b->recordCount)--;
+        memmove( &b->records[i], &b->records[i+1],
+                 ( b->recordCount - i ) * sizeof( tr_record_t ) );
+    }
+}
+
+/***********************************************************************
+ * tr_banPieceRecorded
+ ***********************************************************************
+ * Returns 1 if tr_banPiecePassed will need the data of the piece
+ **********************************************************************/
+int tr_banPieceRecorded( tr_ban_t * b, int piece )
+{
+    tr_torrent_t * tor = b->tor;
+    int            i, startBlock, endBlock;
+
+    startBlock = tr_pieceStartBlock( piece );
+    endBlock   = startBlock + tr_pieceCountBlocks( piece );
+
+    for( i = 0; i < b->recordCount; i++ )
+    {
+        if( b->records[i].block >= startBlock &&
+            b->records[i].block < endBlock )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int tr_banIsBanned( tr_ban_t * b, struct in_addr addr )
+{
+    int i;
+
+    for( i = 0; i < b->bannedCount; i++ )
+    {
+        if( b->banned[i].s_addr == addr.s_addr )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void tr_banClose( tr_ban_t * b )
+{
+    free( b->blockFrom );
+    free( b->records );
+    if( b->banned )
+    {
+        free( b->banned );
+    }
+    free( b );
+}
+
+static void ban( tr_ban_t * b, struct in_addr addr )
+{
+    if( !addr.s_addr )
+    {
+        /* The block was there when we started */
+        return;
+    }
+    if( tr_banIsBanned( b, addr ) )
+    {
+        return;
+    }
+
+    tr_inf( "%08x sent corrupt data, banning it", addr.s_addr );
+
+    if( b->bannedCount >= b->bannedMax )
+    {
+        b->bannedMax = b->bannedMax ? 2 * b->bannedMax : 16;
+        b->banned    = realloc( b->banned,
+                                b->bannedMax * sizeof( struct in_addr ) );
+    }
+    b->banned[(b->bannedCount)++] = addr;
+}
@@ -0,0 +1,36 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TR_SMARTBAN_H
+#define TR_SMARTBAN_H 1
+
+typedef struct tr_ban_s tr_ban_t;
+
+tr_ban_t * tr_banInit         ( tr_torrent_t * );
+void       tr_banBlockFrom    ( tr_ban_t *, int, struct in_addr );
+void       tr_banPieceFailed  ( tr_ban_t *, int, uint8_t * );
+void       tr_banPiecePassed  ( tr_ban_t *, int, uint8_t * );
+int        tr_banPieceRecorded( tr_ban_t *, int );
+int        tr_banIsBanned     ( tr_ban_t *, struct in_addr );
+void       tr_banClose        ( tr_ban_t * );
+
+#endif
@@ -135,6 +135,28 @@ static void sendQuery( tr_tracker_t * tc )
     int        peers;
     int        ret;
 
+    /* Make sure we are connected before sending anything */
+    ret = tr_netCheckConnect( tc->socket );
+    if( ret & TR_NET_CLOSE )
+    {
+        tr_inf( "Tracker: connection failed" );
+        tr_netClose( tc->socket );
+        tc->status = TC_STATUS_IDLE;
+        return;
+    }
+    if( ret & TR_NET_BLOCK )
+    {
+        if( tr_date() > tc->date + TR_ANNOUNCE_INTERVAL * 3000 )
+        {
+            /* This is taking too long */
+            tr_inf( "Tracker: timeout reached (%d s)",
+                    TR_ANNOUNCE_INTERVAL * 3 );
+            tr_netClose( tc->socket );
+            tc->status = TC_STATUS_IDLE;
+        }
+        return;
+    }
+
     if( tc->started )
         event = "&event=started";
     else if( tc->completed )
@@ -243,7 +265,7 @@ static void recvAnswer( tr_tracker_t * tc )
         return;
     }
 
-    if( tr_bencLoad( &tc->buf[i], &beAll, NULL ) )
+    if( tr_bencLoad( &tc->buf[i], tc->pos - i, &beAll, NULL ) )
     {
         tr_err( "Tracker error: error parsing bencoded data" );
         return;
@@ -353,7 +375,11 @@ int tr_trackerScrape( tr_torrent_t * tor, int * seeders, int * leechers )
 
     for( date = tr_date();; )
     {
-        ret = tr_netSend( s, buf, strlen( buf ) );
+        ret = tr_netCheckConnect( s );
+        if( !ret )
+        {
+            ret = tr_netSend( s, buf, strlen( buf ) );
+        }
         if( ret & TR_NET_CLOSE )
         {
             fprintf( stderr, "Could not connect to tracker\n" );
@@ -418,7 +444,7 @@ int tr_trackerScrape( tr_torrent_t * tor, int * seeders, int * leechers )
     {
         return 1;
     }
-    if( tr_bencLoad( &buf[i], &scrape, NULL ) )
+    if( tr_bencLoad( &buf[i], pos - i, &scrape, NULL ) )
     {
         return 1;
     }
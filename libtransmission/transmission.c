@@ -26,6 +26,7 @@
  * Local prototypes
  **********************************************************************/
 static void  downloadLoop( void * );
+static void  readDone( void *, int );
 static float rateDownload( tr_torrent_t * );
 static float rateUpload( tr_torrent_t * );
 
@@ -56,6 +57,18 @@ tr_handle_t * tr_init()
     /* Initialize rate control */
     h->upload = tr_uploadInit();
 
+    /* Initialize connection control */
+    h->connlimit = tr_connlimitInit();
+
+    /* Initialize open files cache */
+    h->fdlimit = tr_fdInit();
+
+    /* Initialize write and read caches */
+    h->cache = tr_cacheInit();
+
+    /* Start disk threads */
+    h->disk = tr_diskInit();
+
     h->bindPort = 9090;
     
     return h;
@@ -82,6 +95,98 @@ void tr_setUploadLimit( tr_handle_t * h, int limit )
     tr_uploadSetLimit( h->upload, limit );
 }
 
+/***********************************************************************
+ * tr_setRequestQueue
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setRequestQueue( tr_handle_t * h, int depth )
+{
+    tr_uploadSetQueueDepth( h->upload, depth );
+}
+
+/***********************************************************************
+ * tr_setRequestSize
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setRequestSize( tr_handle_t * h, int size )
+{
+    tr_uploadSetRequestSize( h->upload, size );
+}
+
+/***********************************************************************
+ * tr_setConnectLimit
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setConnectLimit( tr_handle_t * h, int halfOpen, int perSecond )
+{
+    tr_connlimitSet( h->connlimit, halfOpen, perSecond );
+}
+
+/***********************************************************************
+ * tr_setOpenFileLimit
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setOpenFileLimit( tr_handle_t * h, int limit )
+{
+    tr_fdSetBudget( h->fdlimit, limit );
+}
+
+/***********************************************************************
+ * tr_setCacheSize
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setCacheSize( tr_handle_t * h, int size )
+{
+    tr_cacheSetLimit( h->cache, size );
+}
+
+/***********************************************************************
+ * tr_setReadCacheSize
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setReadCacheSize( tr_handle_t * h, int size )
+{
+    tr_cacheSetReadLimit( h->cache, size );
+}
+
+/***********************************************************************
+ * tr_setIoUring
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setIoUring( tr_handle_t * h, int enable )
+{
+    h->ioUring = enable;
+}
+
+/***********************************************************************
+ * tr_setDirectIO
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_setDirectIO( tr_handle_t * h, int enable )
+{
+    h->directIO = enable;
+}
+
+/***********************************************************************
+ * tr_cacheStat
+ ***********************************************************************
+ *
+ **********************************************************************/
+void tr_cacheStat( tr_handle_t * h, tr_cachestat_t * s )
+{
+    memset( s, 0, sizeof( tr_cachestat_t ) );
+    tr_fdStat( h->fdlimit, s );
+    tr_cacheFillStat( h->cache, s );
+}
+
 /***********************************************************************
  * tr_torrentCount
  ***********************************************************************
@@ -126,7 +231,6 @@ int tr_torrentInit( tr_handle_t * h, const char * path )
     tr_torrent_t  * tor;
     tr_info_t     * inf;
     int             i;
-    // struct rlimit   lim;
     char          * s1, * s2;
 
     if( h->torrentCount >= TR_MAX_TORRENT_COUNT )
@@ -191,35 +295,26 @@ int tr_torrentInit( tr_handle_t * h, const char * path )
 #endif
     tor->blockCount = ( inf->totalSize + tor->blockSize - 1 ) /
                         tor->blockSize;
+    tr_geometryInit( tor );
     tor->blockHave  = calloc( tor->blockCount, 1 );
     tor->bitfield   = calloc( ( inf->pieceCount + 7 ) / 8, 1 );
+    tor->pieceAvail = calloc( inf->pieceCount, sizeof( int ) );
+    tor->pool       = tr_peerpoolInit();
+    tor->ban        = tr_banInit( tor );
+    tor->reader     = tr_readerInit( tor );
 
     tr_lockInit( &tor->lock );
 
-    tor->upload = h->upload;
+    tor->upload    = h->upload;
+    tor->connlimit = h->connlimit;
+    tor->fdlimit   = h->fdlimit;
+    tor->cache     = h->cache;
+    tor->disk      = h->disk;
  
     /* We have a new torrent */
     h->torrents[h->torrentCount] = tor;
     (h->torrentCount)++;
 
-#if 0
-    /* Increase the authorized number of sockets for the process so we
-       are sure that we actually can open all files and connect to
-       TR_MAX_PEER_COUNT peers for each torrent */
-    lim.rlim_cur = 100;
-    for( i = 0; i < h->torrentCount; i++ )
-    {
-        tor           = h->torrents[i];
-        lim.rlim_cur += tor->info.fileCount + TR_MAX_PEER_COUNT;
-    }
-    lim.rlim_max = lim.rlim_cur;
-
-    if( setrlimit( RLIMIT_NOFILE, &lim ) )
-    {
-        tr_err( "Could not setrlimit (%s, %lld)",
-                strerror( errno ), lim.rlim_cur );
-    }
-#endif
    
     return 0;
 }
@@ -249,6 +344,109 @@ char * tr_torrentGetFolder( tr_handle_t * h, int t )
     return tor->destination;
 }
 
+void tr_torrentSetSuperSeed( tr_handle_t * h, int t, int superSeed )
+{
+    tr_torrent_t * tor = h->torrents[t];
+
+    tr_lockLock( tor->lock );
+    tor->superSeed = superSeed;
+    tr_lockUnlock( tor->lock );
+}
+
+void tr_torrentSetSequential( tr_handle_t * h, int t, int window,
+                              int rate )
+{
+    tr_torrent_t * tor = h->torrents[t];
+
+    tr_lockLock( tor->lock );
+    tor->streamWindow = MAX( window, 0 );
+    tor->streamRate   = MAX( rate, 0 );
+    tor->streamDate   = tr_date();
+    tr_lockUnlock( tor->lock );
+}
+
+void tr_torrentSetCursor( tr_handle_t * h, int t, int file,
+                          uint64_t offset )
+{
+    tr_torrent_t * tor = h->torrents[t];
+    tr_info_t    * inf = &tor->info;
+
+    offset += tor->geo.fileOffset[MIN( MAX( file, 0 ), inf->fileCount )];
+
+    tr_lockLock( tor->lock );
+    tor->streamCursor = MIN( offset, inf->totalSize );
+    tor->streamDate   = tr_date();
+    tr_lockUnlock( tor->lock );
+}
+
+void tr_torrentSetAllocation( tr_handle_t * h, int t, int allocation )
+{
+    tr_torrent_t * tor = h->torrents[t];
+
+    tr_lockLock( tor->lock );
+    tor->allocation = allocation;
+    tr_lockUnlock( tor->lock );
+}
+
+void tr_torrentSetPreallocation( tr_handle_t * h, int t,
+                                 int preallocation )
+{
+    tr_torrent_t * tor = h->torrents[t];
+
+    tr_lockLock( tor->lock );
+    tor->preallocation = preallocation;
+    tr_lockUnlock( tor->lock );
+}
+
+void tr_torrentSetStorage( tr_handle_t * h, int t, int storage )
+{
+    tr_torrent_t * tor = h->torrents[t];
+
+    tr_lockLock( tor->lock );
+    tor->storage = storage;
+    tr_lockUnlock( tor->lock );
+}
+
+int tr_torrentRead( tr_handle_t * h, int t, uint64_t offset,
+                    int length, uint8_t * buf )
+{
+    volatile int status = -1;
+
+    if( tr_torrentReadAsync( h, t, offset, length, buf, readDone,
+                             (void *) &status ) )
+    {
+        return 1;
+    }
+
+    /* We can't hold the lock while waiting, the torrent thread
+       needs it to get the data */
+    while( status < 0 )
+    {
+        tr_wait( 20 );
+    }
+
+    return status;
+}
+
+int tr_torrentReadAsync( tr_handle_t * h, int t, uint64_t offset,
+                         int length, uint8_t * buf,
+                         void (*callback)( void *, int ), void * data )
+{
+    tr_torrent_t * tor = h->torrents[t];
+    int            ret = 1;
+
+    tr_lockLock( tor->lock );
+    if( tor->status & ( TR_STATUS_CHECK | TR_STATUS_DOWNLOAD |
+                        TR_STATUS_SEED ) )
+    {
+        ret = tr_readerAdd( tor->reader, offset, length, buf,
+                            callback, data );
+    }
+    tr_lockUnlock( tor->lock );
+
+    return ret;
+}
+
 void tr_torrentStart( tr_handle_t * h, int t )
 {
     tr_torrent_t * tor = h->torrents[t];
@@ -256,8 +454,11 @@ void tr_torrentStart( tr_handle_t * h, int t )
     int            i;
 
     tor->status      = TR_STATUS_CHECK;
+    tor->checked     = 0;
     tor->tracker     = tr_trackerInit( h, tor );
     tor->bindPort    = h->bindPort;
+    tor->ioUring     = h->ioUring;
+    tor->directIO    = h->directIO;
 #ifndef BEOS_NETSERVER
     tor->bindSocket  = tr_netBind( &tor->bindPort );
 #endif
@@ -327,7 +528,17 @@ void tr_torrentStat( tr_handle_t * h, int t, tr_stat_t * s )
         }
     }
 
-    s->progress = (float) tor->blockHaveCount / (float) tor->blockCount;
+    if( tor->status & TR_STATUS_CHECK )
+    {
+        /* How far we are in checking the files */
+        s->progress = (float) tor->checked /
+                      (float) tor->info.pieceCount;
+    }
+    else
+    {
+        s->progress = (float) tor->blockHaveCount /
+                      (float) tor->blockCount;
+    }
 
     s->rateDownload = rateDownload( tor );
     s->rateUpload   = rateUpload( tor );
@@ -389,8 +600,13 @@ void tr_torrentClose( tr_handle_t * h, int t )
 
     free( inf->pieces );
     free( inf->files );
+    tr_geometryClose( tor );
     free( tor->blockHave );
     free( tor->bitfield );
+    free( tor->pieceAvail );
+    tr_peerpoolClose( tor->pool );
+    tr_banClose( tor->ban );
+    tr_readerClose( tor->reader );
     free( tor );
 
     memmove( &h->torrents[t], &h->torrents[t+1],
@@ -400,6 +616,10 @@ void tr_torrentClose( tr_handle_t * h, int t )
 void tr_close( tr_handle_t * h )
 {
     tr_uploadClose( h->upload );
+    tr_connlimitClose( h->connlimit );
+    tr_fdClose( h->fdlimit );
+    tr_diskClose( h->disk );
+    tr_cacheClose( h->cache );
     free( h );
 }
 
@@ -417,15 +637,38 @@ static void downloadLoop( void * _tor )
     signal( SIGINT, SIG_IGN );
 #endif
 
-    tor->io     = tr_ioInit( tor );
+    tor->error[0] = '\0';
+    tor->io       = tr_ioInit( tor );
+    if( !tor->io )
+    {
+        /* Don't connect to anyone, just wait to be stopped */
+        if( !tor->error[0] )
+        {
+            snprintf( tor->error, sizeof( tor->error ),
+                      "Could not open files in %s", tor->destination );
+        }
+        tr_lockLock( tor->lock );
+        tor->status = TR_STATUS_PAUSE | TR_IO_ERROR;
+        tr_readerFail( tor->reader );
+        tr_lockUnlock( tor->lock );
+        while( !tor->die )
+        {
+            tr_wait( 20 );
+        }
+        return;
+    }
     tor->status = TR_STATUS_DOWNLOAD;
     
     while( !tor->die )
     {
         tr_lockLock( tor->lock );
 
+        /* Learn which pieces passed */
+        tr_ioPulse( tor->io );
+
         /* Are we finished ? */
-        if( tor->blockHaveCount >= tor->blockCount )
+        if( tor->blockHaveCount >= tor->blockCount &&
+            !tr_ioChecking( tor->io ) )
         {
             /* Done */
             tor->status = TR_STATUS_SEED;
@@ -440,6 +683,9 @@ static void downloadLoop( void * _tor )
         /* Try to get new peers */
         tr_trackerPulse( tor->tracker );
 
+        /* Serve the reads we now have the data for */
+        tr_readerPulse( tor->reader );
+
         tr_lockUnlock( tor->lock );
 
         /* Wait up to 20 ms */
@@ -450,9 +696,22 @@ static void downloadLoop( void * _tor )
         }
     }
 
+    tr_lockLock( tor->lock );
+    tr_readerFail( tor->reader );
     tr_ioClose( tor->io );
-
+    tor->io     = NULL;
     tor->status = TR_STATUS_PAUSE;
+    tr_lockUnlock( tor->lock );
+}
+
+/***********************************************************************
+ * readDone
+ ***********************************************************************
+ * Wakes up tr_torrentRead
+ **********************************************************************/
+static void readDone( void * data, int status )
+{
+    *( (volatile int *) data ) = status;
 }
 
 /***********************************************************************
@@ -53,6 +53,120 @@ void          tr_setBindPort   ( tr_handle_t *, int );
  **********************************************************************/
 void          tr_setUploadLimit( tr_handle_t *, int );
 
+/***********************************************************************
+ * tr_setRequestQueue
+ ***********************************************************************
+ * Sets how many block requests we keep in queue for each peer we are
+ * uploading to (default is 256). Requests beyond that are ignored.
+ **********************************************************************/
+void          tr_setRequestQueue( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setRequestSize
+ ***********************************************************************
+ * Sets the largest request, in bytes, we accept from peers (default is
+ * 128 KB, it must be between 16 KB and 1 MB). We advertise it in the
+ * extension handshake, and peers that advertise theirs the same way
+ * are asked for up to that many contiguous bytes at once instead of
+ * 16 KB blocks.
+ **********************************************************************/
+void          tr_setRequestSize( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setConnectLimit
+ ***********************************************************************
+ * Limits, for all torrents together, how many outgoing connections may
+ * be waiting to be established at the same time (default is 8) and how
+ * many connection attempts we start per second (default is 10).
+ **********************************************************************/
+void          tr_setConnectLimit( tr_handle_t *, int, int );
+
+/***********************************************************************
+ * tr_setOpenFileLimit
+ ***********************************************************************
+ * Sets how many files may stay open, for all torrents together
+ * (default is 32). Files are opened when they are first read or
+ * written, and the least recently used one is closed when we need
+ * another.
+ **********************************************************************/
+void          tr_setOpenFileLimit( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setCacheSize
+ ***********************************************************************
+ * Sets how much memory, in bytes, we may use for all torrents together
+ * to hold blocks of the pieces we are downloading (default is 8 MB).
+ * Pieces are checked from memory and written in one go once they
+ * passed; when the cache is full, the oldest pieces of the torrent are
+ * written early, and 0 disables the cache.
+ **********************************************************************/
+void          tr_setCacheSize( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setReadCacheSize
+ ***********************************************************************
+ * Sets how much memory, in bytes, we may use for all torrents together
+ * to keep pieces we upload (default is 16 MB). The first request for
+ * a piece reads all of it, so the following ones and those of other
+ * peers don't touch the disk. 0 disables the cache.
+ **********************************************************************/
+void          tr_setReadCacheSize( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setIoUring
+ ***********************************************************************
+ * Lets torrents started afterwards use io_uring on Linux (default is
+ * off). The disk writes and reads of a piece, and the receives and
+ * sends of a pulse to all peers, then each take one system call, with
+ * open files and the write cache registered with the kernel. Where
+ * io_uring isn't available, the usual system calls are used.
+ **********************************************************************/
+void          tr_setIoUring( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_setDirectIO
+ ***********************************************************************
+ * Lets torrents started afterwards read without the system cache
+ * (O_DIRECT) when they check their files or fill the read cache, so
+ * they don't push other programs' data out of it (default is off).
+ * Only reads aligned to 4 KB bypass it, the others and the systems
+ * without O_DIRECT use the usual calls.
+ **********************************************************************/
+void          tr_setDirectIO( tr_handle_t *, int );
+
+/***********************************************************************
+ * tr_cacheStat
+ ***********************************************************************
+ * Fills the tr_cachestat_t structure with statistics about the open
+ * files cache, the write cache and the read cache.
+ **********************************************************************/
+typedef struct
+{
+    /* Open files */
+    int         fdOpen;
+    int         fdBudget;
+    uint64_t    fdHits;
+    uint64_t    fdMisses;
+    uint64_t    fdEvictions;
+
+    /* Write cache */
+    int         writeLimit;
+    int         writeUsed;
+    uint64_t    writeHits;    /* Pieces checked from memory */
+    uint64_t    writeMisses;  /* Pieces read back from disk to check */
+    uint64_t    writeFlushes; /* Pieces written early to make room */
+
+    /* Read cache */
+    int         readLimit;
+    int         readUsed;
+    uint64_t    readHits;       /* Requests served from memory */
+    uint64_t    readMisses;     /* Requests that read a piece */
+    uint64_t    readPrefetches; /* Pieces read before anyone asked */
+}
+tr_cachestat_t;
+
+void          tr_cacheStat( tr_handle_t *, tr_cachestat_t * );
+
 /***********************************************************************
  * tr_torrentCount
  ***********************************************************************
@@ -89,6 +203,108 @@ int           tr_torrentScrape ( tr_handle_t *, int, int *, int * );
 void          tr_torrentSetFolder( tr_handle_t *, int, const char * );
 char *        tr_torrentGetFolder( tr_handle_t *, int );
 
+/***********************************************************************
+ * tr_torrentSetSuperSeed
+ ***********************************************************************
+ * Enables (1) or disables (0) super-seeding. Once we have the whole
+ * torrent, new peers are shown one piece at a time instead of our full
+ * bitfield, and are offered another one only after somebody else
+ * reports having the first. This helps initial seeders spread every
+ * piece while uploading as little as possible.
+ **********************************************************************/
+void          tr_torrentSetSuperSeed( tr_handle_t *, int, int );
+
+/***********************************************************************
+ * tr_torrentSetSequential
+ ***********************************************************************
+ * Enables sequential mode so files can be consumed while they are
+ * being downloaded: the 'window' pieces following the playback cursor
+ * (see tr_torrentSetCursor) are downloaded first and in order. 'rate'
+ * is how fast the consumer reads, in KB/s; it gives each piece in the
+ * window a deadline, and pieces about to miss it are also requested
+ * from our fastest peers. With a rate of 0, only the piece under the
+ * cursor is treated that way. Other pieces are still picked rarest
+ * first. A window of 0 disables sequential mode.
+ **********************************************************************/
+void          tr_torrentSetSequential( tr_handle_t *, int, int, int );
+
+/***********************************************************************
+ * tr_torrentSetCursor
+ ***********************************************************************
+ * Moves the playback cursor to offset 'offset' in file 'file'.
+ **********************************************************************/
+void          tr_torrentSetCursor( tr_handle_t *, int, int, uint64_t );
+
+/***********************************************************************
+ * tr_torrentRead
+ ***********************************************************************
+ * Reads 'length' bytes at 'offset' in the torrent, as if all files were
+ * concatenated, into 'buf'. The torrent must be started. If we don't
+ * have all the pieces the range covers yet, they are downloaded before
+ * any other, and tr_torrentRead blocks until they are verified. Returns
+ * 0 if successful, 1 if the range is invalid, the torrent is not
+ * running or is stopped before we get the data.
+ **********************************************************************/
+int           tr_torrentRead( tr_handle_t *, int, uint64_t, int,
+                              uint8_t * );
+
+/***********************************************************************
+ * tr_torrentReadAsync
+ ***********************************************************************
+ * Same as tr_torrentRead, but returns immediately. 'callback' is called
+ * with 'data' and the status (0 for success, 1 for failure) once 'buf'
+ * is filled or the read failed, either right away or later from the
+ * torrent thread. It must not call libtransmission functions for this
+ * torrent. Returns 1 if the read can't be queued, in which case the
+ * callback won't be called.
+ **********************************************************************/
+int           tr_torrentReadAsync( tr_handle_t *, int, uint64_t, int,
+                                   uint8_t *, void (*)( void *, int ),
+                                   void * );
+
+/***********************************************************************
+ * tr_torrentSetAllocation
+ ***********************************************************************
+ * Chooses how pieces are stored, from the next tr_torrentStart on.
+ * With TR_ALLOC_COMPACT (default), files only grow as pieces arrive,
+ * which are moved around until they reach their place. With
+ * TR_ALLOC_FULL, each piece is written directly at its final offset.
+ * Resume files from either mode can be used with the other.
+ **********************************************************************/
+#define TR_ALLOC_COMPACT 0
+#define TR_ALLOC_FULL    1
+void          tr_torrentSetAllocation( tr_handle_t *, int, int );
+
+/***********************************************************************
+ * tr_torrentSetPreallocation
+ ***********************************************************************
+ * Chooses what we do with the files when the torrent is started. With
+ * TR_PREALLOC_NONE (default), they are created empty and grow as we
+ * write. With TR_PREALLOC_SPARSE, they are extended to their final
+ * size without using disk space. With TR_PREALLOC_FULL, the disk space
+ * is reserved as well where the system supports it, which avoids
+ * fragmentation. In the last two cases, if the disk is too small the
+ * torrent doesn't start and its status gets TR_IO_ERROR.
+ **********************************************************************/
+#define TR_PREALLOC_NONE   0
+#define TR_PREALLOC_SPARSE 1
+#define TR_PREALLOC_FULL   2
+void          tr_torrentSetPreallocation( tr_handle_t *, int, int );
+
+/***********************************************************************
+ * tr_torrentSetStorage
+ ***********************************************************************
+ * Chooses how we read the files, from the next tr_torrentStart on.
+ * TR_STORAGE_FILE (default) uses system calls. TR_STORAGE_MMAP maps
+ * the files in memory by windows of 32 MB, up to 256 MB per torrent,
+ * which saves a copy for each block we upload and lets the check of
+ * pieces go straight over the system's cache. Writes still use
+ * system calls. Not available on BeOS.
+ **********************************************************************/
+#define TR_STORAGE_FILE 0
+#define TR_STORAGE_MMAP 1
+void          tr_torrentSetStorage( tr_handle_t *, int, int );
+
 /***********************************************************************
  * tr_torrentStart
  ***********************************************************************
@@ -154,6 +370,7 @@ typedef struct
 #define TR_STATUS_DOWNLOAD 0x04
 #define TR_STATUS_SEED     0x08
 #define TR_TRACKER_ERROR   0x20
+#define TR_IO_ERROR        0x40
     int         status;
     char        error[128];
 
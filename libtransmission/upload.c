@@ -24,11 +24,21 @@
 
 #define FOO 10
 
+/* How many requests a peer may have pending by default. Recent clients
+   pipeline a few hundred of them on fast links */
+#define QUEUE_DEPTH 256
+
+/* Largest request we accept, and make, by default. Peers which don't
+   tell us otherwise only get 16 KB requests from us */
+#define REQUEST_SIZE ( 1 << 17 )
+
 struct tr_upload_s
 {
     tr_lock_t lock;
     int       limit;      /* Max upload rate in KB/s */
     int       count;      /* Number of peers currently unchoked */
+    int       queueDepth; /* Max pending requests per peer */
+    int       requestSize; /* Max length of a request, in bytes */
     uint64_t  dates[FOO]; /* The last times we uploaded something */
     int       sizes[FOO]; /* How many bytes we uploaded */
 };
@@ -38,6 +48,8 @@ tr_upload_t * tr_uploadInit()
     tr_upload_t * u;
 
     u = calloc( sizeof( tr_upload_t ), 1 );
+    u->queueDepth  = QUEUE_DEPTH;
+    u->requestSize = REQUEST_SIZE;
     tr_lockInit( &u->lock );
 
     return u;
@@ -50,6 +62,44 @@ void tr_uploadSetLimit( tr_upload_t * u, int limit )
     tr_lockUnlock( u->lock );
 }
 
+void tr_uploadSetQueueDepth( tr_upload_t * u, int depth )
+{
+    tr_lockLock( u->lock );
+    u->queueDepth = MAX( depth, 1 );
+    tr_lockUnlock( u->lock );
+}
+
+int tr_uploadQueueDepth( tr_upload_t * u )
+{
+    int ret;
+
+    tr_lockLock( u->lock );
+    ret = u->queueDepth;
+    tr_lockUnlock( u->lock );
+
+    return ret;
+}
+
+void tr_uploadSetRequestSize( tr_upload_t * u, int size )
+{
+    /* Every client handles 16 KB requests, and we don't want peers to
+       make us buffer more than 1 MB per message */
+    tr_lockLock( u->lock );
+    u->requestSize = MIN( MAX( size, 1 << 14 ), 1 << 20 );
+    tr_lockUnlock( u->lock );
+}
+
+int tr_uploadRequestSize( tr_upload_t * u )
+{
+    int ret;
+
+    tr_lockLock( u->lock );
+    ret = u->requestSize;
+    tr_lockUnlock( u->lock );
+
+    return ret;
+}
+
 int tr_uploadCanUnchoke( tr_upload_t * u )
 {
     int ret;
@@ -125,6 +175,44 @@ int tr_uploadCanUpload( tr_upload_t * u )
     return ret;
 }
 
+/***********************************************************************
+ * tr_uploadAllowance
+ ***********************************************************************
+ * How many bytes we may send right now without going over the limit,
+ * by the same measure as tr_uploadCanUpload, but at most one second
+ * worth of it
+ **********************************************************************/
+int tr_uploadAllowance( tr_upload_t * u )
+{
+    int      ret, i;
+    int64_t  size, allowed;
+    uint64_t now;
+
+    tr_lockLock( u->lock );
+    if( u->limit <= 0 )
+    {
+        /* No limit, or only messages (see tr_uploadCanUpload) */
+        ret = INT_MAX;
+    }
+    else
+    {
+        ret  = 0;
+        size = 0;
+        now  = tr_date();
+
+        for( i = 0; i < FOO; i++ )
+        {
+            size   += u->sizes[i];
+            allowed = (int64_t) MIN( now - u->dates[i], 1000 ) *
+                      1024 * u->limit / 1000 - size;
+            ret     = MAX( ret, allowed );
+        }
+    }
+    tr_lockUnlock( u->lock );
+
+    return ret;
+}
+
 void tr_uploadUploaded( tr_upload_t * u, int size )
 {
     tr_lockLock( u->lock );
@@ -24,9 +24,14 @@ typedef struct tr_upload_s tr_upload_t;
 
 tr_upload_t * tr_uploadInit();
 void          tr_uploadSetLimit( tr_upload_t *, int );
+void          tr_uploadSetQueueDepth( tr_upload_t *, int );
+int           tr_uploadQueueDepth( tr_upload_t * );
+void          tr_uploadSetRequestSize( tr_upload_t *, int );
+int           tr_uploadRequestSize( tr_upload_t * );
 int           tr_uploadCanUnchoke( tr_upload_t * );
 void          tr_uploadChoked( tr_upload_t * );
 void          tr_uploadUnchoked( tr_upload_t * );
 int           tr_uploadCanUpload( tr_upload_t * );
+int           tr_uploadAllowance( tr_upload_t * );
 void          tr_uploadUploaded( tr_upload_t *, int );
 void          tr_uploadClose( tr_upload_t * );
@@ -0,0 +1,693 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "transmission.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Same numbers on every architecture, in case the C library doesn't
+   know them yet */
+#ifndef __NR_io_uring_setup
+#  define __NR_io_uring_setup    425
+#  define __NR_io_uring_enter    426
+#  define __NR_io_uring_register 427
+#endif
+
+/* Entries per ring, and files each ring keeps registered */
+#define ENTRIES    128
+#define FILE_SLOTS 64
+
+/* Blocks of the write cache come from this pool while io_uring is on.
+   Every ring registers it, so writing them out doesn't make the kernel
+   look up and pin their pages each time. Blocks are at most 32 KB */
+#define POOL_CHUNK ( 1 << 15 )
+#define POOL_SIZE  ( 8 * 1024 * 1024 )
+#define POOL_COUNT ( POOL_SIZE / POOL_CHUNK )
+
+typedef struct
+{
+    int pending; /* Completions we still wait for */
+    int result;  /* Bytes transferred, or -errno */
+}
+tr_uringop_t;
+
+struct tr_uring_s
+{
+    int                   fd;
+    uint8_t             * sqRing;
+    size_t                sqRingSize;
+    uint8_t             * cqRing;
+    size_t                cqRingSize;
+    struct io_uring_sqe * sqes;
+    size_t                sqesSize;
+
+    unsigned            * sqHead;
+    unsigned            * sqTail;
+    unsigned            * sqArray;
+    unsigned              sqMask;
+    unsigned            * cqHead;
+    unsigned            * cqTail;
+    unsigned              cqMask;
+    struct io_uring_cqe * cqes;
+
+    unsigned              tail;      /* What we will store in sqTail */
+    int                   queued;    /* Entries not submitted yet */
+    int                   submitted; /* The ops below are done */
+    int                   opCount;
+    tr_uringop_t          ops[ENTRIES];
+
+    /* Registered descriptors (-1 = free slot), and whether the current
+       batch uses each slot */
+    int                   hasFiles;
+    int                   files[FILE_SLOTS];
+    char                  fileUsed[FILE_SLOTS];
+    int                   fileNext;
+    unsigned              fileGen;
+
+    int                   hasPool;
+    int                   hasNet;
+};
+
+static pthread_once_t    uringOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t     uringKey;
+static volatile int      broken = 0;
+static volatile unsigned closeGen = 0;
+
+static volatile int      poolReady = 0;
+static tr_lock_t         poolLock;
+static uint8_t         * pool = NULL;
+static int               poolFree[POOL_COUNT];
+static int               poolFreeCount = 0;
+
+static void         uringInit ();
+static tr_uring_t * ringOpen  ();
+static void         ringClose ( void * );
+static int          newOp     ( tr_uring_t *, int );
+static void         queueSqe  ( tr_uring_t *, int, int, int, int,
+                                void *, unsigned, uint64_t );
+static int          fileSlot  ( tr_uring_t *, int );
+static int          inPool    ( void *, size_t );
+
+/***********************************************************************
+ * tr_uringGet
+ ***********************************************************************
+ * Returns the ring of the calling thread, or NULL if we can't use
+ * io_uring. Each thread gets its own ring the first time it asks, and
+ * keeps it until it exits. If the kernel doesn't let us create one, we
+ * stop trying and everything goes through the usual system calls.
+ **********************************************************************/
+tr_uring_t * tr_uringGet()
+{
+    tr_uring_t * u;
+
+    if( broken )
+    {
+        return NULL;
+    }
+
+    pthread_once( &uringOnce, uringInit );
+    if( !( u = pthread_getspecific( uringKey ) ) && ( u = ringOpen() ) )
+    {
+        pthread_setspecific( uringKey, u );
+    }
+
+    return u;
+}
+
+/***********************************************************************
+ * tr_uringFile
+ ***********************************************************************
+ * Queues a positional read or write of the 'count' buffers in 'iov',
+ * which must stay untouched until tr_uringSubmit. Returns the op to
+ * give to tr_uringResult, or -1 if the ring is full. Blocks from the
+ * pool are written as registered buffers, one entry each.
+ **********************************************************************/
+int tr_uringFile( tr_uring_t * u, int fd, uint64_t pos, struct iovec * iov,
+                  int count, int write )
+{
+    int i, op, slot, fixed;
+
+    fixed = write && u->hasPool;
+    for( i = 0; i < count && fixed; i++ )
+    {
+        fixed = inPool( iov[i].iov_base, iov[i].iov_len );
+    }
+
+    if( count > IOV_MAX || ( op = newOp( u, fixed ? count : 1 ) ) < 0 )
+    {
+        return -1;
+    }
+    slot = fileSlot( u, fd );
+
+    if( !fixed )
+    {
+        queueSqe( u, op, write ? IORING_OP_WRITEV : IORING_OP_READV,
+                  fd, slot, iov, count, pos );
+        return op;
+    }
+    for( i = 0; i < count; i++ )
+    {
+        queueSqe( u, op, IORING_OP_WRITE_FIXED, fd, slot,
+                  iov[i].iov_base, iov[i].iov_len, pos );
+        pos += iov[i].iov_len;
+    }
+
+    return op;
+}
+
+/***********************************************************************
+ * tr_uringRecv, tr_uringSend
+ ***********************************************************************
+ * Queue a recv() or send() which won't wait for the socket to be
+ * ready. Return the op, or -1 if the ring is full or the kernel is too
+ * old for them.
+ **********************************************************************/
+int tr_uringRecv( tr_uring_t * u, int s, char * buf, int size )
+{
+    int op;
+
+    if( !u->hasNet || ( op = newOp( u, 1 ) ) < 0 )
+    {
+        return -1;
+    }
+    queueSqe( u, op, IORING_OP_RECV, s, -1, buf, size, 0 );
+    u->sqes[(u->tail - 1) & u->sqMask].msg_flags = MSG_DONTWAIT;
+
+    return op;
+}
+
+int tr_uringSend( tr_uring_t * u, int s, char * buf, int size )
+{
+    int op;
+
+    if( !u->hasNet || ( op = newOp( u, 1 ) ) < 0 )
+    {
+        return -1;
+    }
+    queueSqe( u, op, IORING_OP_SEND, s, -1, buf, size, 0 );
+    u->sqes[(u->tail - 1) & u->sqMask].msg_flags =
+        MSG_DONTWAIT | MSG_NOSIGNAL;
+
+    return op;
+}
+
+/***********************************************************************
+ * tr_uringSubmit
+ ***********************************************************************
+ * Submits everything queued with one system call, and waits until all
+ * of it is done. Results stay available until something else is
+ * queued.
+ **********************************************************************/
+void tr_uringSubmit( tr_uring_t * u )
+{
+    struct io_uring_cqe * cqe;
+    tr_uringop_t        * op;
+    unsigned              head, toSubmit;
+    int                   i, ret, pending;
+
+    if( u->submitted )
+    {
+        return;
+    }
+
+    __atomic_store_n( u->sqTail, u->tail, __ATOMIC_RELEASE );
+    pending  = u->queued;
+    toSubmit = u->queued;
+    while( pending > 0 )
+    {
+        ret = syscall( __NR_io_uring_enter, u->fd, toSubmit, pending,
+                       IORING_ENTER_GETEVENTS, NULL, 0 );
+        if( ret < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY )
+        {
+            tr_err( "io_uring_enter failed (%s)", strerror( errno ) );
+            break;
+        }
+
+        head = *u->cqHead;
+        while( head != __atomic_load_n( u->cqTail, __ATOMIC_ACQUIRE ) )
+        {
+            cqe = &u->cqes[head & u->cqMask];
+            op  = &u->ops[cqe->user_data];
+            if( cqe->res < 0 )
+            {
+                op->result = cqe->res;
+            }
+            else if( op->result >= 0 )
+            {
+                op->result += cqe->res;
+            }
+            (op->pending)--;
+            pending--;
+            head++;
+        }
+        __atomic_store_n( u->cqHead, head, __ATOMIC_RELEASE );
+
+        toSubmit = u->tail -
+            __atomic_load_n( u->sqHead, __ATOMIC_ACQUIRE );
+    }
+
+    for( i = 0; i < u->opCount; i++ )
+    {
+        if( u->ops[i].pending > 0 )
+        {
+            u->ops[i].result = -EIO;
+        }
+    }
+    if( pending > 0 )
+    {
+        /* We can't tell what the kernel still holds, don't use the
+           ring anymore */
+        broken = 1;
+    }
+    memset( u->fileUsed, 0, FILE_SLOTS );
+    u->queued    = 0;
+    u->submitted = 1;
+}
+
+/***********************************************************************
+ * tr_uringResult
+ ***********************************************************************
+ * How many bytes the op transferred, or -errno if it failed
+ **********************************************************************/
+int tr_uringResult( tr_uring_t * u, int op )
+{
+    return u->ops[op].result;
+}
+
+/***********************************************************************
+ * tr_uringClosed
+ ***********************************************************************
+ * Called whenever a file is closed. Rings forget about all the files
+ * they registered before they use one again, as a descriptor may now
+ * be another file.
+ **********************************************************************/
+void tr_uringClosed()
+{
+    __atomic_add_fetch( &closeGen, 1, __ATOMIC_RELEASE );
+}
+
+/***********************************************************************
+ * tr_uringAlloc, tr_uringFree
+ ***********************************************************************
+ * Memory for a block of the write cache: from the registered pool once
+ * a ring was set up and if there is room left, from malloc() otherwise
+ **********************************************************************/
+uint8_t * tr_uringAlloc( int size )
+{
+    uint8_t * buf = NULL;
+
+    if( poolReady && !broken && size <= POOL_CHUNK )
+    {
+        tr_lockLock( poolLock );
+        if( poolFreeCount > 0 )
+        {
+            buf = &pool[POOL_CHUNK * poolFree[--poolFreeCount]];
+        }
+        tr_lockUnlock( poolLock );
+    }
+
+    return buf ? buf : malloc( size );
+}
+
+void tr_uringFree( uint8_t * buf )
+{
+    if( poolReady && buf >= pool && buf < &pool[POOL_SIZE] )
+    {
+        tr_lockLock( poolLock );
+        poolFree[poolFreeCount++] = ( buf - pool ) / POOL_CHUNK;
+        tr_lockUnlock( poolLock );
+        return;
+    }
+    free( buf );
+}
+
+/***********************************************************************
+ * Following functions are local
+ **********************************************************************/
+
+static void uringInit()
+{
+    int i;
+
+    pthread_key_create( &uringKey, ringClose );
+    tr_lockInit( &poolLock );
+
+    pool = mmap( NULL, POOL_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( pool == MAP_FAILED )
+    {
+        pool = NULL;
+        return;
+    }
+    for( i = 0; i < POOL_COUNT; i++ )
+    {
+        poolFree[i] = POOL_COUNT - 1 - i;
+    }
+    poolFreeCount = POOL_COUNT;
+    poolReady     = 1;
+}
+
+/***********************************************************************
+ * ringOpen
+ ***********************************************************************
+ * Sets up a ring and maps its queues. Registering files and the pool
+ * may fail with older kernels or a low limit of locked memory, we then
+ * do without them.
+ **********************************************************************/
+static tr_uring_t * ringOpen()
+{
+    struct io_uring_params p;
+    struct iovec           iov;
+    tr_uring_t           * u;
+    int                    i, fd;
+
+    memset( &p, 0, sizeof( p ) );
+    fd = syscall( __NR_io_uring_setup, ENTRIES, &p );
+    if( fd < 0 )
+    {
+        tr_inf( "io_uring not available (%s), using the usual calls",
+                strerror( errno ) );
+        broken = 1;
+        return NULL;
+    }
+
+    u     = calloc( sizeof( tr_uring_t ), 1 );
+    u->fd = fd;
+
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    u->cqRingSize = p.cq_off.cqes +
+        p.cq_entries * sizeof( struct io_uring_cqe );
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        u->sqRingSize = MAX( u->sqRingSize, u->cqRingSize );
+        u->cqRingSize = u->sqRingSize;
+    }
+    u->sqesSize = p.sq_entries * sizeof( struct io_uring_sqe );
+
+    u->sqRing = mmap( NULL, u->sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if( u->sqRing != MAP_FAILED &&
+        !( p.features & IORING_FEAT_SINGLE_MMAP ) )
+    {
+        u->cqRing = mmap( NULL, u->cqRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_CQ_RING );
+    }
+    else
+    {
+        u->cqRing = u->sqRing;
+    }
+    u->sqes = mmap( NULL, u->sqesSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if( u->sqRing == MAP_FAILED || u->cqRing == MAP_FAILED ||
+        u->sqes == MAP_FAILED )
+    {
+        tr_err( "Could not map io_uring queues (%s)", strerror( errno ) );
+        ringClose( u );
+        broken = 1;
+        return NULL;
+    }
+
+    u->sqHead  = (unsigned *) ( u->sqRing + p.sq_off.head );
+    u->sqTail  = (unsigned *) ( u->sqRing + p.sq_off.tail );
+    u->sqArray = (unsigned *) ( u->sqRing + p.sq_off.array );
+    u->sqMask  = *(unsigned *) ( u->sqRing + p.sq_off.ring_mask );
+    u->cqHead  = (unsigned *) ( u->cqRing + p.cq_off.head );
+    u->cqTail  = (unsigned *) ( u->cqRing + p.cq_off.tail );
+    u->cqMask  = *(unsigned *) ( u->cqRing + p.cq_off.ring_mask );
+    u->cqes    = (struct io_uring_cqe *) ( u->cqRing + p.cq_off.cqes );
+    u->tail    = *u->sqTail;
+
+    /* Non-blocking recv and send came with the same kernel (5.6) as
+       fast poll, roughly */
+    u->hasNet = ( p.features & IORING_FEAT_FAST_POLL ) != 0;
+
+    for( i = 0; i < FILE_SLOTS; i++ )
+    {
+        u->files[i] = -1;
+    }
+    u->fileGen  = closeGen;
+    u->hasFiles = !syscall( __NR_io_uring_register, fd,
+                            IORING_REGISTER_FILES, u->files, FILE_SLOTS );
+
+    if( pool )
+    {
+        iov.iov_base = pool;
+        iov.iov_len  = POOL_SIZE;
+        u->hasPool   = !syscall( __NR_io_uring_register, fd,
+                                 IORING_REGISTER_BUFFERS, &iov, 1 );
+    }
+
+    tr_dbg( "io_uring ready (files %s, pool %s, sockets %s)",
+            u->hasFiles ? "yes" : "no", u->hasPool ? "yes" : "no",
+            u->hasNet ? "yes" : "no" );
+
+    return u;
+}
+
+static void ringClose( void * _u )
+{
+    tr_uring_t * u = _u;
+
+    if( u->sqes && u->sqes != MAP_FAILED )
+    {
+        munmap( u->sqes, u->sqesSize );
+    }
+    if( u->cqRing && u->cqRing != MAP_FAILED && u->cqRing != u->sqRing )
+    {
+        munmap( u->cqRing, u->cqRingSize );
+    }
+    if( u->sqRing && u->sqRing != MAP_FAILED )
+    {
+        munmap( u->sqRing, u->sqRingSize );
+    }
+    close( u->fd );
+    free( u );
+}
+
+/***********************************************************************
+ * newOp
+ ***********************************************************************
+ * Reserves an op which takes 'sqes' entries, starting a new batch if
+ * the last one was submitted. Returns -1 if there is no room.
+ **********************************************************************/
+static int newOp( tr_uring_t * u, int sqes )
+{
+    tr_uringop_t * op;
+
+    if( u->submitted )
+    {
+        u->opCount   = 0;
+        u->submitted = 0;
+    }
+    if( u->opCount >= ENTRIES || u->queued + sqes > ENTRIES )
+    {
+        return -1;
+    }
+
+    op          = &u->ops[u->opCount];
+    op->pending = sqes;
+    op->result  = 0;
+
+    return (u->opCount)++;
+}
+
+static void queueSqe( tr_uring_t * u, int op, int opcode, int fd,
+                      int slot, void * addr, unsigned len, uint64_t off )
+{
+    struct io_uring_sqe * sqe;
+    unsigned              index = u->tail & u->sqMask;
+
+    sqe = &u->sqes[index];
+    memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t) addr;
+    sqe->len       = len;
+    sqe->off       = off;
+    sqe->user_data = op;
+    if( slot >= 0 )
+    {
+        sqe->fd     = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    u->sqArray[index] = index;
+    (u->tail)++;
+    (u->queued)++;
+}
+
+/***********************************************************************
+ * fileSlot
+ ***********************************************************************
+ * Returns the registered slot of 'fd', registering it if needed, or
+ * -1 if the plain descriptor should be used. A slot queued entries
+ * refer to is never changed before they are submitted.
+ **********************************************************************/
+static int fileSlot( tr_uring_t * u, int fd )
+{
+    struct io_uring_files_update up;
+    unsigned                     gen;
+    int                          i;
+
+    if( !u->hasFiles )
+    {
+        return -1;
+    }
+
+    gen = __atomic_load_n( &closeGen, __ATOMIC_ACQUIRE );
+    if( u->fileGen != gen )
+    {
+        /* A file was closed somewhere, what we registered may be stale.
+           Start over, unless this batch already uses a slot */
+        for( i = 0; i < FILE_SLOTS; i++ )
+        {
+            if( u->fileUsed[i] )
+            {
+                return -1;
+            }
+        }
+        for( i = 0; i < FILE_SLOTS; i++ )
+        {
+            u->files[i] = -1;
+        }
+        memset( &up, 0, sizeof( up ) );
+        up.fds = (uintptr_t) u->files;
+        if( syscall( __NR_io_uring_register, u->fd,
+                     IORING_REGISTER_FILES_UPDATE, &up, FILE_SLOTS ) < 0 )
+        {
+            u->hasFiles = 0;
+            return -1;
+        }
+        u->fileGen = gen;
+    }
+
+    for( i = 0; i < FILE_SLOTS; i++ )
+    {
+        if( u->files[i] == fd )
+        {
+            u->fileUsed[i] = 1;
+            return i;
+        }
+    }
+
+    i           = u->fileNext;
+    u->fileNext = ( i + 1 ) % FILE_SLOTS;
+    if( u->fileUsed[i] )
+    {
+        return -1;
+    }
+
+    memset( &up, 0, sizeof( up ) );
+    up.offset = i;
+    up.fds    = (uintptr_t) &fd;
+    if( syscall( __NR_io_uring_register, u->fd,
+                 IORING_REGISTER_FILES_UPDATE, &up, 1 ) < 0 )
+    {
+        u->files[i] = -1;
+        return -1;
+    }
+    u->files[i]    = fd;
+    u->fileUsed[i] = 1;
+
+    return i;
+}
+
+static int inPool( void * buf, size_t len )
+{
+    return pool && (uint8_t *) buf >= pool &&
+           (uint8_t *) buf + len <= &pool[POOL_SIZE];
+}
+
+#else
+
+/* No io_uring here, always use the usual calls */
+tr_uring_t * tr_uringGet()
+{
+    return NULL;
+}
+
+int tr_uringFile( tr_uring_t * u, int fd, uint64_t pos, struct iovec * iov,
+                  int count, int write )
+{
+    (void) u;
+    (void) fd;
+    (void) pos;
+    (void) iov;
+    (void) count;
+    (void) write;
+
+    return -1;
+}
+
+int tr_uringRecv( tr_uring_t * u, int s, char * buf, int size )
+{
+    (void) u;
+    (void) s;
+    (void) buf;
+    (void) size;
+
+    return -1;
+}
+
+int tr_uringSend( tr_uring_t * u, int s, char * buf, int size )
+{
+    (void) u;
+    (void) s;
+    (void) buf;
+    (void) size;
+
+    return -1;
+}
+
+void tr_uringSubmit( tr_uring_t * u )
+{
+    (void) u;
+}
+
+int tr_uringResult( tr_uring_t * u, int op )
+{
+    (void) u;
+    (void) op;
+
+    return -1;
+}
+
+void tr_uringClosed()
+{
+}
+
+uint8_t * tr_uringAlloc( int size )
+{
+    return malloc( size );
+}
+
+void tr_uringFree( uint8_t * buf )
+{
+    free( buf );
+}
+
+#endif
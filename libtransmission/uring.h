@@ -0,0 +1,39 @@
+/******************************************************************************
+ * Copyright (c) 2005 Eric Petit
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TR_URING_H
+#define TR_URING_H 1
+
+typedef struct tr_uring_s tr_uring_t;
+
+tr_uring_t * tr_uringGet    ();
+int          tr_uringFile   ( tr_uring_t *, int, uint64_t, struct iovec *,
+                              int, int );
+int          tr_uringRecv   ( tr_uring_t *, int, char *, int );
+int          tr_uringSend   ( tr_uring_t *, int, char *, int );
+void         tr_uringSubmit ( tr_uring_t * );
+int          tr_uringResult ( tr_uring_t *, int );
+void         tr_uringClosed ();
+uint8_t    * tr_uringAlloc  ( int );
+void         tr_uringFree   ( uint8_t * );
+
+#endif
@@ -61,3 +61,115 @@ int tr_rand( int sup )
     }
     return rand() % sup;
 }
+
+/* Returns n if a is 2^n, -1 if it isn't a power of 2 */
+static int log2Of( int a )
+{
+    int n;
+
+    for( n = 0; a > 1 && !( a & 1 ); n++ )
+    {
+        a >>= 1;
+    }
+
+    return ( a == 1 ) ? n : -1;
+}
+
+/***********************************************************************
+ * tr_geometryInit
+ ***********************************************************************
+ * Computes tor->geo once blockSize and blockCount are known
+ **********************************************************************/
+void tr_geometryInit( tr_torrent_t * tor )
+{
+    tr_info_t     * inf = &tor->info;
+    tr_geometry_t * geo = &tor->geo;
+
+    int      i, file, last;
+    uint64_t start, end;
+
+    geo->blocksPerPiece  = inf->pieceSize / tor->blockSize;
+    geo->pieceShift      = log2Of( geo->blocksPerPiece );
+    geo->blockShift      = log2Of( tor->blockSize );
+    geo->lastPieceSize   = inf->totalSize % inf->pieceSize;
+    geo->lastPieceSize   = geo->lastPieceSize ? geo->lastPieceSize :
+                           inf->pieceSize;
+    geo->lastPieceBlocks = tor->blockCount % geo->blocksPerPiece;
+    geo->lastPieceBlocks = geo->lastPieceBlocks ? geo->lastPieceBlocks :
+                           geo->blocksPerPiece;
+    geo->lastBlockSize   = inf->totalSize % tor->blockSize;
+    geo->lastBlockSize   = geo->lastBlockSize ? geo->lastBlockSize :
+                           tor->blockSize;
+
+    geo->fileOffset = malloc( ( inf->fileCount + 1 ) * sizeof( uint64_t ) );
+    geo->fileOffset[0] = 0;
+    for( i = 0; i < inf->fileCount; i++ )
+    {
+        geo->fileOffset[i+1] = geo->fileOffset[i] + inf->files[i].length;
+    }
+
+    /* The file that holds a byte is the last one that starts at or
+       before it: files of length 0 are skipped that way */
+    geo->pieceFiles = malloc( 2 * inf->pieceCount * sizeof( int ) );
+    for( i = 0, file = 0; i < inf->pieceCount; i++ )
+    {
+        start = (uint64_t) i * (uint64_t) inf->pieceSize;
+        end   = start + tr_pieceSize( i ) - 1;
+        while( file + 1 < inf->fileCount &&
+               geo->fileOffset[file+1] <= start )
+        {
+            file++;
+        }
+        geo->pieceFiles[2*i] = file;
+        for( last = file; last + 1 < inf->fileCount &&
+             geo->fileOffset[last+1] <= end; last++ );
+        geo->pieceFiles[2*i+1] = last;
+    }
+}
+
+/***********************************************************************
+ * tr_geometryFile
+ ***********************************************************************
+ * Returns the file that holds byte 'offset' of the torrent and sets
+ * 'posInFile', or returns fileCount if 'offset' is past the end. Only
+ * the files of the piece are looked at.
+ **********************************************************************/
+int tr_geometryFile( tr_torrent_t * tor, uint64_t offset,
+                     uint64_t * posInFile )
+{
+    tr_info_t     * inf = &tor->info;
+    tr_geometry_t * geo = &tor->geo;
+    int             piece, first, last, middle;
+
+    *posInFile = 0;
+    if( offset >= (uint64_t) inf->totalSize )
+    {
+        return inf->fileCount;
+    }
+
+    /* The last file that starts at or before 'offset' */
+    piece = offset / inf->pieceSize;
+    first = geo->pieceFiles[2*piece];
+    last  = geo->pieceFiles[2*piece+1];
+    while( first < last )
+    {
+        middle = ( first + last + 1 ) / 2;
+        if( geo->fileOffset[middle] <= offset )
+        {
+            first = middle;
+        }
+        else
+        {
+            last = middle - 1;
+        }
+    }
+
+    *posInFile = offset - geo->fileOffset[first];
+    return first;
+}
+
+void tr_geometryClose( tr_torrent_t * tor )
+{
+    free( tor->geo.fileOffset );
+    free( tor->geo.pieceFiles );
+}
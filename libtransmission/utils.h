@@ -33,6 +33,10 @@ void tr_msg  ( int level, char * msg, ... );
 
 int  tr_rand ( int );
 
+void tr_geometryInit ( tr_torrent_t * );
+int  tr_geometryFile ( tr_torrent_t *, uint64_t, uint64_t * );
+void tr_geometryClose( tr_torrent_t * );
+
 /***********************************************************************
  * tr_date
  ***********************************************************************
@@ -75,73 +79,84 @@ static inline void tr_bitfieldAdd( uint8_t * bitfield, int piece )
     bitfield[ piece / 8 ] |= ( 1 << ( 7 - ( piece % 8 ) ) );
 }
 
+/***********************************************************************
+ * tr_bitfieldRem
+ **********************************************************************/
+static inline void tr_bitfieldRem( uint8_t * bitfield, int piece )
+{
+    bitfield[ piece / 8 ] &= ~( 1 << ( 7 - ( piece % 8 ) ) );
+}
+
 #define tr_blockPiece(a) _tr_blockPiece(tor,a)
 static inline int _tr_blockPiece( tr_torrent_t * tor, int block )
 {
-    tr_info_t * inf = &tor->info;
-    return block / ( inf->pieceSize / tor->blockSize );
+    if( tor->geo.pieceShift > -1 )
+    {
+        return block >> tor->geo.pieceShift;
+    }
+    return block / tor->geo.blocksPerPiece;
 }
 
 #define tr_blockSize(a) _tr_blockSize(tor,a)
 static inline int _tr_blockSize( tr_torrent_t * tor, int block )
 {
-    tr_info_t * inf = &tor->info;
-    int dummy;
-
-    if( block != tor->blockCount - 1 ||
-        !( dummy = inf->totalSize % tor->blockSize ) )
+    if( block != tor->blockCount - 1 )
     {
         return tor->blockSize;
     }
-
-    return dummy;
+    return tor->geo.lastBlockSize;
 }
 
 #define tr_blockPosInPiece(a) _tr_blockPosInPiece(tor,a)
 static inline int _tr_blockPosInPiece( tr_torrent_t * tor, int block )
 {
-    tr_info_t * inf = &tor->info;
-    return tor->blockSize *
-        ( block % ( inf->pieceSize / tor->blockSize ) );
+    if( tor->geo.pieceShift > -1 && tor->geo.blockShift > -1 )
+    {
+        return ( block & ( tor->geo.blocksPerPiece - 1 ) ) <<
+            tor->geo.blockShift;
+    }
+    return tor->blockSize * ( block % tor->geo.blocksPerPiece );
 }
 
 #define tr_pieceCountBlocks(a) _tr_pieceCountBlocks(tor,a)
 static inline int _tr_pieceCountBlocks( tr_torrent_t * tor, int piece )
 {
-    tr_info_t * inf = &tor->info;
-    if( piece < inf->pieceCount - 1 ||
-        !( tor->blockCount % ( inf->pieceSize / tor->blockSize ) ) )
+    if( piece < tor->info.pieceCount - 1 )
     {
-        return inf->pieceSize / tor->blockSize;
+        return tor->geo.blocksPerPiece;
     }
-    return tor->blockCount % ( inf->pieceSize / tor->blockSize );
+    return tor->geo.lastPieceBlocks;
 }
 
 #define tr_pieceStartBlock(a) _tr_pieceStartBlock(tor,a)
 static inline int _tr_pieceStartBlock( tr_torrent_t * tor, int piece )
 {
-    tr_info_t * inf = &tor->info;
-    return piece * ( inf->pieceSize / tor->blockSize );
+    if( tor->geo.pieceShift > -1 )
+    {
+        return piece << tor->geo.pieceShift;
+    }
+    return piece * tor->geo.blocksPerPiece;
 }
 
 #define tr_pieceSize(a) _tr_pieceSize(tor,a)
 static inline int _tr_pieceSize( tr_torrent_t * tor, int piece )
 {
-    tr_info_t * inf = &tor->info;
-    if( piece < inf->pieceCount - 1 ||
-        !( inf->totalSize % inf->pieceSize ) )
+    if( piece < tor->info.pieceCount - 1 )
     {
-        return inf->pieceSize;
+        return tor->info.pieceSize;
     }
-    return inf->totalSize % inf->pieceSize;
+    return tor->geo.lastPieceSize;
 }
 
 #define tr_block(a,b) _tr_block(tor,a,b)
 static inline int _tr_block( tr_torrent_t * tor, int index, int begin )
 {
-    tr_info_t * inf = &tor->info;
-    return index * ( inf->pieceSize / tor->blockSize ) +
-        begin / tor->blockSize;
+    if( tor->geo.pieceShift > -1 && tor->geo.blockShift > -1 )
+    {
+        return ( index << tor->geo.pieceShift ) +
+            ( begin >> tor->geo.blockShift );
+    }
+    return index * tor->geo.blocksPerPiece + begin / tor->blockSize;
 }
 
 #endif
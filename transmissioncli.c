@@ -36,7 +36,18 @@
 "  -s, --scrape         Print counts of seeders/leechers and exit\n" \
 "  -v, --verbose <int>  Verbose level (0 to 2, default = 0)\n" \
 "  -p, --port <int>     Port we should listen on (default = 9090)\n" \
-"  -u, --upload <int>   Maximum upload rate (-1 = no limit, default = 20)\n"
+"  -u, --upload <int>   Maximum upload rate (-1 = no limit, default = 20)\n" \
+"  -S, --super-seed     Reveal pieces one at a time when seeding\n" \
+"  -w, --window <int>   Download in order, <int> pieces ahead (default = 0)\n" \
+"  -a, --allocate       Write pieces directly at their final place\n" \
+"  -r, --reserve <int>  Preallocate files (0 = no, 1 = sparse, 2 = full)\n" \
+"  -f, --files <int>    Maximum number of open files (default = 32)\n" \
+"  -c, --cache <int>    Write cache size in KB (default = 8192)\n" \
+"  -k, --read-cache <int> Read cache size in KB (default = 16384)\n" \
+"  -m, --mmap           Read files through mmap()\n" \
+"  -U, --io-uring       Batch disk and network I/O with io_uring\n" \
+"  -D, --direct         Read without the system cache when checking\n" \
+"                       and caching (O_DIRECT)\n"
 
 static int             showHelp     = 0;
 static int             showInfo     = 0;
@@ -44,6 +55,16 @@ static int             showScrape   = 0;
 static int             verboseLevel = 0;
 static int             bindPort     = 9090;
 static int             uploadLimit  = 20;
+static int             superSeed    = 0;
+static int             window       = 0;
+static int             allocation   = TR_ALLOC_COMPACT;
+static int             reserve      = TR_PREALLOC_NONE;
+static int             openFiles    = 32;
+static int             cacheSize    = 8192;
+static int             readCache    = 16384;
+static int             storage      = TR_STORAGE_FILE;
+static int             ioUring      = 0;
+static int             directIO     = 0;
 static char          * torrentPath  = NULL;
 static volatile char   mustDie      = 0;
 
@@ -153,8 +174,18 @@ int main( int argc, char ** argv )
 
     tr_setBindPort( h, bindPort );
     tr_setUploadLimit( h, uploadLimit );
+    tr_setOpenFileLimit( h, openFiles );
+    tr_setCacheSize( h, cacheSize * 1024 );
+    tr_setReadCacheSize( h, readCache * 1024 );
+    tr_setIoUring( h, ioUring );
+    tr_setDirectIO( h, directIO );
     
     tr_torrentSetFolder( h, 0, "." );
+    tr_torrentSetSuperSeed( h, 0, superSeed );
+    tr_torrentSetSequential( h, 0, window, 0 );
+    tr_torrentSetAllocation( h, 0, allocation );
+    tr_torrentSetPreallocation( h, 0, reserve );
+    tr_torrentSetStorage( h, 0, storage );
     tr_torrentStart( h, 0 );
 
     while( !mustDie )
@@ -190,7 +221,12 @@ int main( int argc, char ** argv )
         string[79] = '\0';
         fprintf( stderr, "\r%s", string );
 
-        if( trStat.status & TR_TRACKER_ERROR )
+        if( trStat.status & TR_IO_ERROR )
+        {
+            fprintf( stderr, "\n%s\n", trStat.error );
+            break;
+        }
+        else if( trStat.status & TR_TRACKER_ERROR )
         {
             fprintf( stderr, "\n%s\n", trStat.error );
         }
@@ -223,10 +259,20 @@ static int parseCommandLine( int argc, char ** argv )
             { "verbose", required_argument, NULL, 'v' },
             { "port",    required_argument, NULL, 'p' },
             { "upload",  required_argument, NULL, 'u' },
+            { "super-seed", no_argument,    NULL, 'S' },
+            { "window",  required_argument, NULL, 'w' },
+            { "allocate", no_argument,      NULL, 'a' },
+            { "reserve", required_argument, NULL, 'r' },
+            { "files",   required_argument, NULL, 'f' },
+            { "cache",   required_argument, NULL, 'c' },
+            { "read-cache", required_argument, NULL, 'k' },
+            { "mmap",    no_argument,       NULL, 'm' },
+            { "io-uring", no_argument,      NULL, 'U' },
+            { "direct",  no_argument,       NULL, 'D' },
             { 0, 0, 0, 0 } };
 
         int c, optind = 0;
-        c = getopt_long( argc, argv, "hisv:p:u:", long_options, &optind );
+        c = getopt_long( argc, argv, "hisv:p:u:Sw:ar:f:c:k:mUD", long_options, &optind );
         if( c < 0 )
         {
             break;
@@ -251,6 +297,36 @@ static int parseCommandLine( int argc, char ** argv )
             case 'u':
                 uploadLimit = atoi( optarg );
                 break;
+            case 'S':
+                superSeed = 1;
+                break;
+            case 'w':
+                window = atoi( optarg );
+                break;
+            case 'a':
+                allocation = TR_ALLOC_FULL;
+                break;
+            case 'r':
+                reserve = atoi( optarg );
+                break;
+            case 'f':
+                openFiles = atoi( optarg );
+                break;
+            case 'c':
+                cacheSize = atoi( optarg );
+                break;
+            case 'k':
+                readCache = atoi( optarg );
+                break;
+            case 'm':
+                storage = TR_STORAGE_MMAP;
+                break;
+            case 'U':
+                ioUring = 1;
+                break;
+            case 'D':
+                directIO = 1;
+                break;
             default:
                 return 1;
         }